@@ -3,8 +3,56 @@
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #include <chrono>
-#include <windows.h>
 #include <vector>
+#include <map>
+#include <string>
+#include <tuple>
+#include <cstddef>          // offsetof
+#include <cstring>          // strcmp
+#include <cstdint>          // uint64_t sort keys
+#include <cassert>
+#include <new>
+#include <algorithm>        // min
+#include <set>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <random>           // synthetic scenes for the benchmarks
+#include <cfloat>           // FLT_MAX
+#include <cmath>            // sqrt, fabs
+#include <fstream>          // headless screenshots, scene files
+#include <cstdio>           // remove
+
+// Windows sleeps round up to the system timer tick, so frame pacing waits on
+// a high resolution timer there instead
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <mmsystem.h>       // timeBeginPeriod
+#pragma comment(lib, "winmm.lib")
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#endif
+
+// x86 builds get SSE and AVX2 ring kernels, picked at startup from what the CPU
+// supports, and SSE frustum culling
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>         // __cpuid
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Debug builds, and builds defining ENABLE_PROFILER, time scopes of the frame
+// on the CPU and GPU; elsewhere the PROFILE_ macros compile to nothing
+#if defined(_DEBUG) || defined(ENABLE_PROFILER)
+#define PROFILER
+#endif
 #include "camera.h"
 
 // image
@@ -18,9 +66,75 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/constants.hpp>
 
 using namespace std; // Standard namespace
 
+#ifdef _DEBUG
+// Debug builds count every heap allocation so the frame loop can assert that it makes none.
+// The count is per thread, so allocations made by driver worker threads are not included.
+// Array and nothrow forms fall through to these. The replacements stay out of line: GCC
+// warns about free() on memory from operator new wherever it inlines only the delete half.
+thread_local size_t gAllocationCount = 0;
+
+#ifdef _MSC_VER
+#define ALLOCATOR_NOINLINE __declspec(noinline)
+#else
+#define ALLOCATOR_NOINLINE __attribute__((noinline))
+#endif
+
+ALLOCATOR_NOINLINE void* operator new(std::size_t size)
+{
+    ++gAllocationCount;
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+
+    throw std::bad_alloc();
+}
+
+ALLOCATOR_NOINLINE void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+ALLOCATOR_NOINLINE void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+// over-aligned types; MSVC has no aligned_alloc, and its aligned blocks need _aligned_free
+ALLOCATOR_NOINLINE void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    ++gAllocationCount;
+    const size_t align = static_cast<size_t>(alignment);
+#ifdef _MSC_VER
+    if (void* memory = _aligned_malloc(size ? size : 1, align))
+        return memory;
+#else
+    // aligned_alloc wants the size to be a multiple of the alignment
+    if (void* memory = std::aligned_alloc(align, (size + align - 1) / align * align + (size ? 0 : align)))
+        return memory;
+#endif
+
+    throw std::bad_alloc();
+}
+
+ALLOCATOR_NOINLINE void operator delete(void* memory, std::align_val_t) noexcept
+{
+#ifdef _MSC_VER
+    _aligned_free(memory);
+#else
+    std::free(memory);
+#endif
+}
+
+ALLOCATOR_NOINLINE void operator delete(void* memory, std::size_t, std::align_val_t alignment) noexcept
+{
+    operator delete(memory, alignment);
+}
+#endif
+
 /*Shader program Macro*/
 #ifndef GLSL
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
@@ -35,45 +149,114 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Height in pixels of what is drawn to: the window's framebuffer, which
+    // resizes and may not match the window on high DPI screens, or the
+    // headless offscreen target
+    int gViewportHeight = WINDOW_HEIGHT;
+
     enum Material {matte, satin, gloss, glow};
 
-    // Structure used to store mesh data
+    // Shape a mesh was generated from; part of the geometry cache key
+    enum Primitive {cube, plane, circle, cylinder, hollowCylinder, cone};
+    const char* const gPrimitiveNames[] = { "cube", "plane", "circle", "cylinder", "hollow cylinder", "cone" };
+
+    // Words scene files name the primitives and materials with, in enum order
+    const char* const gScenePrimitiveKeywords[] = { "cube", "plane", "circle", "cylinder", "hollow-cylinder", "cone" };
+    const char* const gSceneMaterialKeywords[] = { "matte", "satin", "gloss", "glow" };
+
+    // Scene drawn at startup; --scene file picks another, text or binary
+    const char* gScenePath = "scenes/desk.scene";
+
+    // Texture paths named by the loaded scene files; meshes point into it
+    set<string> gSceneStrings;
+
+    // Binary scene files start with the magic, then this header, the texture
+    // paths (each a length and its characters) and one record per object
+    const char SCENE_BINARY_MAGIC[4] = { 'S', 'C', 'N', 'B' };
+    const uint32_t SCENE_BINARY_VERSION = 1;
+
+    // Most sides a scene file may give a round primitive
+    const float MAX_SCENE_SIDES = 65536.0f;
+    const GLuint SCENE_PARAMETERS = 24;     // floats in GLMesh::p
+
+    struct SceneFileHeader
+    {
+        uint32_t version;
+        uint32_t nStrings;
+        uint32_t nObjects;
+    };
+
+    struct SceneRecord
+    {
+        uint8_t primitive;
+        uint8_t material;
+        uint16_t reserved;
+        uint32_t texture;       // index of its texture path
+        float p[SCENE_PARAMETERS];
+        float height;
+        float length;
+        float radius;
+        float innerRadius;
+        float sides;
+        float transparency;
+    };
+    static_assert(sizeof(SceneRecord) == 128, "scene records are stored as they are laid out");
+
+    // Structure used to store mesh data. This is the cold authoring record: it is
+    // only read while the scene is built, and the render loop draws from the
+    // much smaller GLDrawItem (the hot record) captured from it.
     struct GLMesh
     {
-        //vertex array
-        GLuint vao;
-        //vertex buffer
-        GLuint vbo;
-        //vertex buffer
-        GLuint vbos[2];
+        //vertex array; the geometry arena's for every shape that fits in it
+        GLuint vao = 0;
+        //vertex buffer (vbos[0]) and element buffer (vbos[1]); only set for
+        //shapes too big for the arena, which get buffers of their own
+        GLuint vbos[2] = { 0, 0 };
         //indices of the mesh
         GLuint nIndices;
-
-        //indices to draw
+        //GL_UNSIGNED_SHORT when every vertex fits in 16 bits, GL_UNSIGNED_INT otherwise
+        GLenum indexType = GL_UNSIGNED_INT;
+        //where the mesh lives in its buffers: first vertex (added to every
+        //index when drawing) and first index, plus its vertex count
+        GLint baseVertex = 0;
+        GLuint firstIndex = 0;
+        GLuint nVertices = 0;
+        //identifies the uploaded geometry; meshes sharing it draw together
+        GLuint geometryId = 0;
+        //box around the generated vertices, before the model matrix, and the
+        //radius of the sphere around the box centre holding them all
+        glm::vec3 boundsMin = glm::vec3(0.0f);
+        glm::vec3 boundsMax = glm::vec3(0.0f);
+        float boundsRadius = 0.0f;
+
+        //vertices and the triangles indexing them; released by UTranslator once
+        //uploaded (picking keeps its own compact copy). Meshes without indices
+        //draw their vertices in order.
         std::vector<float> v;
+        std::vector<GLuint> indices;
         //translation properties of the shape
         std::vector<float> p;
 
-        //physical properties of the shape
-        float height;
-        float length;
-        float radius;
-        float innerRadius;
-        float number_of_sides;
+        // scene index of the mesh this is a coarser tessellation of; such
+        // meshes only provide a level of detail and are never drawn on their own
+        GLint lodOf = -1;
 
-        // each shape gets a matrix object
-        glm::mat4 scale;
-        glm::mat4 xrotation;
-        glm::mat4 yrotation;
-        glm::mat4 zrotation;
-        glm::mat4 rotation;
-        glm::mat4 translation;
+        //physical properties of the shape
+        Primitive primitive = cube;
+        float height = 0.0f;
+        float length = 0.0f;
+        float radius = 0.0f;
+        float innerRadius = 0.0f;
+        float number_of_sides = 0.0f;
+
+        // combined transform of the shape; the individual scale, rotation and
+        // translation matrices only exist while UTranslator builds it
         glm::mat4 model;
         glm::vec2 gUVScale;
 
-        // texture information
+        // texture information; the layer is the image's in gSceneTextures
         const char* texFilename;
-        GLuint textureId;
+        GLuint textureLayer;
 
         GLuint lightSourceId;
 
@@ -89,15 +272,38 @@ namespace
         //GLint gTextWrapMode = GL_MIRRORED_REPEAT;
         //GLint gTextWrapMode = GL_CLAMP_TO_EDGE;
         //GLint gTextWrapMode = GL_CLAMP_TO_BORDER;
+    };
 
 
+    // Read-only record of everything needed to draw one mesh, built once from the
+    // scene after the meshes and textures are created. The render loop works only
+    // on these so it never copies a GLMesh or touches its vertex data.
+    struct GLDrawItem
+    {
+        glm::mat4 model;
+        glm::vec2 uvScale;
+        float transparency;
+        GLuint vao;
+        GLuint geometryId;
+        GLint baseVertex;
+        GLuint firstIndex;
+        GLuint nIndices;
+        GLenum indexType;
+        GLuint textureLayer;
+        GLuint lightSourceId;
+        Material material;
+
+        // world space bounding sphere
+        glm::vec3 boundsCentre;
+        float boundsRadius;
 
-        class Mesh
-        {
-        };
+        // levels of detail in gLodLevels, coarsest first, and the one the
+        // geometry fields above currently hold; lodCount is 0 for fixed meshes
+        GLuint lodFirst;
+        GLuint lodCount;
+        GLuint lod;
     };
 
-
     //Mesh used to render the light cubes
     struct GLightMesh
     {
@@ -116,14 +322,506 @@ namespace
     //Mesh vector, holds the shapes that make up the scene
     vector<GLMesh> scene;
 
+    // Shapes only differ by their model matrix, so meshes generated from the same
+    // primitive and parameters share one set of GPU buffers
+    struct GeometryKey
+    {
+        Primitive primitive;
+        float radius;
+        float innerRadius;
+        float height;
+        float number_of_sides;
+        bool transparent;       // transparent shapes keep the generators' triangle order
+
+        bool operator<(const GeometryKey& other) const
+        {
+            return std::tie(primitive, radius, innerRadius, height, number_of_sides, transparent)
+                < std::tie(other.primitive, other.radius, other.innerRadius, other.height, other.number_of_sides, other.transparent);
+        }
+    };
+
+    // GPU buffers of one cached shape and the number of meshes using them
+    struct GLGeometry
+    {
+        GLuint vao;
+        GLuint vbos[2];
+        GLint baseVertex;
+        GLuint firstIndex;
+        GLuint nVertices;
+        GLuint nIndices;
+        GLenum indexType;
+        GLuint geometryId;
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+        float boundsRadius;
+        GLuint refCount;
+    };
+
+    map<GeometryKey, GLGeometry> gGeometryCache;
+    GLuint gNextGeometryId = 0;
+
+    // Free run of vertices or indices in the geometry arena
+    struct ArenaRange
+    {
+        GLuint first;
+        GLuint count;
+    };
+
+    // All static scene geometry shares one vertex buffer and one 16-bit index
+    // buffer behind a single vao, so drawing the scene never switches buffers.
+    // Each mesh owns a range of vertices (drawn with a base vertex) and a range
+    // of indices, handed out first-fit from the free lists. The buffers double
+    // when a range doesn't fit.
+    struct GeometryArena
+    {
+        GLuint vao = 0;
+        GLuint vbo = 0;
+        GLuint ebo = 0;
+        GLuint vertexCapacity = 0;
+        GLuint indexCapacity = 0;
+        // sorted by first; neighbouring runs are always merged
+        vector<ArenaRange> freeVertices;
+        vector<ArenaRange> freeIndices;
+    };
+
+    GeometryArena gArena;
+
+    // Vertices as the generators write them: position, normal (padded to 4), uv
+    const GLuint FLOATS_PER_VERTEX = 9;
+
+    // First float of the position, normal and uv in a generated vertex,
+    // indexed by the attribute location the shaders read them from
+    const GLuint GENERATED_ATTRIBUTE_FLOAT[] = { 0, 3, 7 };
+
+    // One per-vertex attribute of a vertex format
+    struct VertexAttribute
+    {
+        GLuint location;
+        GLint components;
+        GLenum type;            // GL_FLOAT, GL_HALF_FLOAT or GL_INT_2_10_10_10_REV
+        GLboolean normalized;
+        GLuint offset;          // bytes into the vertex
+    };
+
+    // How vertices are laid out in a GPU buffer; drives both the packing of
+    // the generated vertices and the vertex attribute setup
+    struct VertexFormat
+    {
+        const char* name;
+        GLuint stride;
+        vector<VertexAttribute> attributes;
+    };
+
+    // Plain floats: position, normal, uv. 32 bytes.
+    const VertexFormat gFloatVertexFormat = { "float", 32, {
+        { 0, 3, GL_FLOAT, GL_FALSE, 0 },
+        { 1, 3, GL_FLOAT, GL_FALSE, 12 },
+        { 2, 2, GL_FLOAT, GL_FALSE, 24 } } };
+
+    // Float position, normal as signed 10 bits per axis, half float uv. 20 bytes.
+    const VertexFormat gCompactVertexFormat = { "compact", 20, {
+        { 0, 3, GL_FLOAT, GL_FALSE, 0 },
+        { 1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 12 },
+        { 2, 2, GL_HALF_FLOAT, GL_FALSE, 16 } } };
+
+    // Most a normal packed in the compact format may differ from the unit
+    // normal it came from, per component; 10-bit snorm steps are 1/511
+    const float PACKED_NORMAL_TOLERANCE = 0.005f;
+
+    // Format of the scene geometry; picked before the arena is created
+    const VertexFormat* gVertexFormat = &gCompactVertexFormat;
+
+    // Unit circle sampled once per side count and shared by every generator.
+    // Entries run from 0 to sides + 1 since the fans reach one point past the
+    // end; entry sides is entry 0 again, so every ring closes exactly.
+    struct RingTable
+    {
+        vector<float> cosines;
+        vector<float> sines;
+    };
+
+    map<float, RingTable> gRingTables;
+
+    // Startup phases in the order they ran and how long each took, in ms
+    vector<pair<string, double>> gStartupPhases;
+    chrono::steady_clock::time_point gStartupPhaseStart = chrono::steady_clock::now();
+
+    // Describes one ring of vertices for UPutRing. Vertex i of the ring, with
+    // c and s the ring table's cosine and sine of i, gets
+    //   position (0.5 + radius * c, y, 0.5 + radius * s)
+    //   normal   (normalScale * c, normalY, normalScale * s), made unit length
+    //   texture  (uOrigin + uCos * c + uStep * i, vOrigin + vSin * s)
+    // which covers the cap, wall and peak rings of every round shape.
+    struct RingSpec
+    {
+        float radius;
+        float y;
+        float normalScale;
+        float normalY;
+        float uOrigin;
+        float uCos;
+        float uStep;
+        float vOrigin;
+        float vSin;
+    };
+
+    // Ring kernels fill up to RING_BATCH vertices at a time into a
+    // structure-of-arrays batch: x, z, normal x, normal z, u, v. UPutRing then
+    // interleaves the batch into the mesh.
+    const GLuint RING_BATCH = 64;
+    typedef void (*RingKernel)(const float* cosines, const float* sines, GLuint first, GLuint count, const RingSpec& spec, float batch[6][RING_BATCH]);
+
+    // Ring kernel picked by USelectRingKernel, and its name for the logs
+    RingKernel gRingKernel = nullptr;
+    const char* gRingKernelName = "scalar";
+
+    // Write position of a generator filling a mesh's vertex and index arrays.
+    // The arrays are sized once from the exact counts up front, so a build
+    // allocates each of them once and the result is never copied.
+    struct VertexWriter
+    {
+        float* vertex;          // next float to write in mesh.v
+        GLuint* index;          // next index to write in mesh.indices
+        GLuint nVertices = 0;   // vertices written so far, i.e. the index of the next one
+#ifdef _DEBUG
+        size_t allocationsBefore;
+#endif
+    };
+
+    // Average cache miss ratio (vertex shader runs per triangle) of a mesh's
+    // indices before and after UOptimizeMesh reordered them
+    struct MeshOptimizeStats
+    {
+        float acmrBefore = 0.0f;
+        float acmrAfter = 0.0f;
+    };
+
+    // Post-transform cache size the ACMR is measured with, a FIFO as on most GPUs
+    const GLuint ACMR_CACHE_SIZE = 16;
+
+    // Draw list built from the scene; this is what gets rendered every frame
+    vector<GLDrawItem> gDrawList;
+
+    // Side counts round meshes are also built with, where below their own
+    const float LOD_SIDES[] = { 8.0f, 16.0f, 32.0f, 64.0f };
+
+    // Most a level's outline may stray from the true circle on screen, in pixels
+    const float LOD_PIXEL_ERROR = 0.5f;
+
+    // A coarser level is only taken once it has this much more than the sides
+    // needed, so a mesh sitting on a threshold doesn't pop back and forth
+    const float LOD_HYSTERESIS = 0.25f;
+
+    // Geometry of one level of detail of a draw item
+    struct LodLevel
+    {
+        float sides;
+        GLuint vao;
+        GLuint geometryId;
+        GLint baseVertex;
+        GLuint firstIndex;
+        GLuint nIndices;
+        GLenum indexType;
+    };
+
+    vector<LodLevel> gLodLevels;
+
+    // World space boxes of the draw items as centre and half extent, one array
+    // per component so the culling tests several boxes at once. Padded to a
+    // multiple of CULL_BATCH; built by UBuildDrawList.
+    const GLuint CULL_BATCH = 4;
+    struct CullBounds
+    {
+        vector<float> centreX, centreY, centreZ;
+        vector<float> extentX, extentY, extentZ;
+    };
+
+    CullBounds gCullBounds;
+
+    // Result of the frustum test for each draw item this frame
+    vector<unsigned char> gVisible;
+
+    // Bounding volume hierarchy over a set of boxes. Nodes live in one array
+    // with the two children of a node next to each other, and each leaf
+    // points at a run of the items array.
+    struct BvhNode
+    {
+        glm::vec3 boundsMin;
+        GLuint leftFirst;       // first child of an inner node, first item of a leaf
+        glm::vec3 boundsMax;
+        GLuint count;           // items in a leaf, 0 for inner nodes
+    };
+
+    struct Bvh
+    {
+        vector<glm::vec3> itemMin;  // box of every item, filled in before UBuildBvh
+        vector<glm::vec3> itemMax;
+        vector<BvhNode> nodes;      // root first
+        vector<GLuint> items;       // item indices in leaf order
+        vector<GLuint> parents;     // parent of every node, for refitting
+        vector<GLuint> leafOf;      // leaf holding every item
+    };
+
+    // Leaves stop splitting at this many items or this depth, and the surface
+    // area heuristic tries this many split planes per axis
+    const GLuint BVH_LEAF_ITEMS = 4;
+    const GLuint BVH_MAX_DEPTH = 64;
+    const int BVH_BINS = 12;
+
+    // Culling walks the hierarchy once the scene has this many draw items;
+    // below that the SIMD loop over every box is faster
+    const GLuint BVH_CULL_MIN_ITEMS = 256;
+
+    // Hierarchy over the world boxes of the draw items
+    Bvh gSceneBvh;
+
+    // CPU copy of an uploaded shape for picking: positions, triangles and a
+    // hierarchy over the triangles, in the shape's own space
+    struct PickGeometry
+    {
+        vector<glm::vec3> positions;
+        vector<GLuint> indices;
+        Bvh bvh;
+    };
+
+    // Pick data of every full detail shape, under the geometry cache's key, so
+    // meshes sharing a shape's buffers share its pick data too
+    map<GeometryKey, PickGeometry> gPickGeometry;
+
+    // What a picking ray hit: the scene index of the mesh, the point in
+    // world space and how far along the ray it is
+    struct PickHit
+    {
+        GLint mesh = -1;
+        glm::vec3 point = glm::vec3(0.0f);
+        float distance = 0.0f;
+    };
+
+    // Per-instance vertex attributes of one mesh, read by the material vertex
+    // shaders at locations 3 - 9. Meshes sharing geometry and program are drawn
+    // together as one instanced draw; each instance samples its own layer.
+    struct GLInstance
+    {
+        glm::mat4 model;
+        float transparency;
+        glm::vec2 uvScale;
+        float textureLayer;     // layer of gSceneTextures
+    };
+
+    // Every image of the scene is one layer of this array texture, so one
+    // binding serves every draw. Layers share one size: the largest width
+    // and height among the images, up to MAX_TEXTURE_LAYER_SIZE.
+    GLuint gSceneTextures = 0;
+    const int MAX_TEXTURE_LAYER_SIZE = 2048;
+
+    // How URenderScene submits the scene; M switches between them so both can be compared
+    enum RenderPath {perMeshPath, indirectPath};
+    RenderPath gRenderPath = indirectPath;
+    const char* const gRenderPathNames[] = { "per-mesh", "indirect" };
+
+    // --headless N renders N frames of a scripted camera path into an offscreen
+    // framebuffer, without a window or input, then prints frame times and
+    // exits. Every frame advances the same fixed time so runs repeat exactly.
+    GLuint gHeadlessFrames = 0;
+    const float HEADLESS_FRAME_TIME = 1.0f / 60.0f;
+    const char* gScreenshotPath = nullptr;     // --screenshot file.ppm saves the last headless frame
+
+    // --check-culling draws every headless frame a second time with culling
+    // off and fails the run if any pixel differs, or if the SIMD or hierarchy
+    // culling disagrees with the scalar test on any box; on its own it runs
+    // 120 frames
+    bool gCheckCulling = false;
+    bool gCullingEnabled = true;
+    GLuint gCullMismatches = 0;
+
+    // Colour and depth the headless frames are drawn into
+    struct OffscreenTarget
+    {
+        GLuint fbo = 0;
+        GLuint renderbuffers[2] = {};
+    };
+
+    OffscreenTarget gOffscreen;
+
+#ifdef PROFILER
+    // One timed span of a frame, in microseconds since the profiler started.
+    // GPU spans start where their commands were issued.
+    struct ProfileEvent
+    {
+        const char* name;
+        double start;
+        double duration;
+        bool gpu;
+    };
+
+    // Events go into a ring of the most recent PROFILE_EVENTS. GPU timer
+    // queries go into a ring PROFILE_GPU_FRAMES frames deep, so reading a
+    // result back never waits on a frame the GPU is still drawing.
+    const GLuint PROFILE_EVENTS = 1 << 16;
+    const GLuint PROFILE_GPU_FRAMES = 4;
+    const GLuint PROFILE_GPU_SCOPES = 8;
+
+    struct GpuQueryFrame
+    {
+        GLuint queries[PROFILE_GPU_SCOPES];
+        const char* names[PROFILE_GPU_SCOPES];
+        double starts[PROFILE_GPU_SCOPES];
+        GLuint count;
+    };
+
+    struct Profiler
+    {
+        chrono::steady_clock::time_point epoch;
+        vector<ProfileEvent> events;    // oldest at next once full
+        GLuint next = 0;
+        bool full = false;
+        GpuQueryFrame gpuFrames[PROFILE_GPU_FRAMES];
+        GLuint frame = 0;
+        bool gpuScopeOpen = false;
+    };
+
+    Profiler gProfiler;
+
+    // T writes the recorded events to gTracePath; --trace file.json picks the
+    // file and also writes it on exit
+    const char* gTracePath = "profile.json";
+    bool gTraceRequested = false;
+    bool gTraceAtExit = false;
+#endif
+
+    // The scripted camera circles this point at the start camera's distance and height
+    glm::vec3 gCameraPathCentre;
+    float gCameraPathRadius = 0.0f;
+    float gCameraPathHeight = 0.0f;
+    float gCameraPathStartAngle = 0.0f;
+
+    // Layout of one glMultiDrawElementsIndirect command
+    struct DrawElementsCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // One glMultiDrawElementsIndirect call of the indirect path: a run of
+    // batches sharing program and vao. Textures don't split a run: every draw
+    // samples gSceneTextures at its instances' own layer. Batches keep their
+    // queue order inside the run, so transparent shapes still blend back to
+    // front.
+    struct IndirectGroup
+    {
+        GLuint program;
+        GLuint vao;
+        GLenum indexType;
+        GLuint firstCommand;
+        GLuint nCommands;
+        GLuint nInstances;
+        GLuint nTriangles;
+    };
+
+    // Commands of the frame and the buffer they are read from; sized by UBuildDrawList
+    GLuint gIndirectBuffer = 0;
+    vector<DrawElementsCommand> gIndirectCommands;
+    vector<IndirectGroup> gIndirectGroups;
+
+    // Instance buffer every mesh vao reads its per-instance attributes from;
+    // refilled once per frame in render queue order
+    GLuint gInstanceVbo = 0;
+    vector<GLInstance> gInstances;
+
+    // Shader program object; every uniform location is resolved once at link time
+    // so the draw loop never has to look a uniform up by name
+    // Camera and light data live in the shared FrameBlock uniform buffer,
+    // so only the per-draw uniforms are tracked here
+    struct GLShaderProgram
+    {
+        GLuint id = 0;
+
+        // transform matrix; only the lamp program has one, the material
+        // programs take theirs from the instance buffer
+        GLint modelLoc = -1;
+    };
+
+    // CPU mirror of the std140 FrameBlock uniform block declared in every shader.
+    // vec3 members are padded out to 16 bytes as std140 requires.
+    struct FrameUniforms
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec3 lightColor;           // spot light
+        float pad0;
+        glm::vec3 lightPos;
+        float pad1;
+        glm::vec3 keyLightColor;        // key light
+        float pad2;
+        glm::vec3 keyLightPos;
+        float pad3;
+        glm::vec3 ambientLightColor;
+        float pad4;
+        glm::vec3 viewPosition;         // camera
+        float pad5;
+    };
+    static_assert(sizeof(FrameUniforms) == 224, "FrameUniforms must match the std140 FrameBlock layout");
+
+    // Binding point of the FrameBlock uniform buffer
+    const GLuint FRAME_UNIFORM_BINDING = 0;
+
+    // Uniform buffer holding the FrameBlock; uploaded once per frame
+    GLuint gFrameUbo = 0;
+
     // Shader programs
-    GLuint gProgramIdMatte;
-    GLuint gProgramIdSatin;
-    GLuint gProgramIdGloss;
-    GLuint gProgramIdGlow;
-    GLuint gLightProgramId;
+    GLShaderProgram gProgramMatte;
+    GLShaderProgram gProgramSatin;
+    GLShaderProgram gProgramGloss;
+    GLShaderProgram gProgramGlow;
+    GLShaderProgram gLightProgram;
+
+    const GLShaderProgram* gUseProgram = nullptr;
+
+    // Program used for each Material, indexed by the Material value
+    GLShaderProgram* const gMaterialPrograms[] = { &gProgramMatte, &gProgramSatin, &gProgramGloss, &gProgramGlow };
+
+    // One entry of the render queue: a sort key and the draw item it draws.
+    // Key layout, most significant bit first:
+    //   opaque:      [63] 0 | [62-60] program | [59-44] geometry | [43-20] depth, near to far
+    //   transparent: [63] 1 | [62-39] depth, far to near | [38-36] program | [35-20] geometry
+    // Textures are left out: every draw samples the same array texture.
+    struct RenderQueueEntry
+    {
+        uint64_t key;
+        GLuint itemIndex;
+    };
 
-    GLuint gUseProgramId;
+    // Render queue and the radix sort's ping-pong buffer; both keep their capacity between frames
+    vector<RenderQueueEntry> gRenderQueue;
+    vector<RenderQueueEntry> gRenderQueueScratch;
+
+    // Far plane shared by both projections, used to quantize depth in the sort key
+    const float FAR_PLANE = 100.0f;
+
+    // Counters for the frame being rendered; reset at the start of every frame
+    struct FrameStats
+    {
+        unsigned int uniformLookups = 0;    // glGetUniformLocation calls made during the frame
+        unsigned int uniformUploads = 0;    // glUniform* calls made during the frame
+        unsigned int bufferUploads = 0;     // uniform and instance buffer updates made during the frame
+        unsigned int drawCalls = 0;
+        unsigned int instances = 0;         // meshes drawn, summed over the instanced draws
+        unsigned int programSwitches = 0;   // glUseProgram calls
+        unsigned int textureSwitches = 0;   // glBindTexture calls
+        unsigned int vaoSwitches = 0;       // glBindVertexArray calls
+        unsigned int triangles = 0;         // triangles submitted, over all instances
+        unsigned int visible = 0;           // draw items inside the view frustum
+        unsigned int culled = 0;            // draw items skipped as outside it
+    };
+
+    FrameStats gFrameStats;
+    FrameStats gStatsTotal;                 // summed over the current reporting interval
+    unsigned int gStatsFrames = 0;
+    float gStatsLastReport = 0.0f;
+    unsigned int gLinkTimeUniformLookups = 0;   // lookups done once while creating the programs
 
  
 
@@ -153,6 +851,50 @@ namespace
     float gDeltaTime = 0.0f; // time between current frame and last frame
     float gLastFrame = 0.0f;
 
+    // How the render loop paces frames: as fast as it can, to the display's
+    // refresh with vsync, or to a target frame time with the limiter. V cycles
+    // through them; --pacing uncapped|vsync|limit and --fps N pick one at start.
+    enum FramePacing {pacingUncapped, pacingVsync, pacingLimited};
+    const char* const gFramePacingNames[] = { "uncapped", "vsync", "limited" };
+
+    struct PacingState
+    {
+        FramePacing mode = pacingVsync;
+        double targetFrameTime = 1.0 / 60.0;    // seconds per frame with the limiter
+        double deadline = 0.0;                  // when the limiter lets the next frame start
+        double sleepMean = 0.001;               // measured length of a 1 ms sleep
+        double sleepDeviation = 0.0005;         // and how much it varies
+
+        // frame start intervals over the current reporting interval
+        double lastFrameStart = 0.0;
+        double intervalSum = 0.0;
+        double intervalSquareSum = 0.0;
+        double intervalMax = 0.0;
+        unsigned int intervals = 0;
+    };
+
+    PacingState gPacing;
+
+    // --on-demand draws a frame only when something on screen changed: the
+    // camera moved, a key toggled something, the window was resized or
+    // uncovered, or the spot light is orbiting. The rest of the time the loop
+    // sleeps in glfwWaitEventsTimeout.
+    bool gOnDemand = false;
+    bool gRedrawNeeded = true;
+    const double ON_DEMAND_TIMEOUT = 1.0;   // longest sleep with no events
+
+    // How the on demand loop spent the current reporting interval
+    struct IdleStats
+    {
+        double waiting = 0.0;       // seconds asleep waiting for events
+        unsigned int wakeups = 0;
+        unsigned int frames = 0;    // frames drawn
+        unsigned int skipped = 0;   // loop passes that found nothing to draw
+        double lastReport = 0.0;
+    };
+
+    IdleStats gIdleStats;
+
     // Light color, position and scale
     glm::vec3 gSpotLightColor(0.7f, 0.7f, 0.6f);
     glm::vec3 gSpotLightPosition(1.5f, 2.0f, -1.5f);
@@ -179,25 +921,177 @@ void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
-void UBuildScene(vector<GLMesh>& scene);
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+bool ULoadScene(const char* path, vector<GLMesh>& scene);
+bool ULoadSceneText(istream& file, const char* path, vector<GLMesh>& scene);
+bool ULoadSceneBinary(istream& file, const char* path, vector<GLMesh>& scene);
+GLMesh& UAddSceneMesh(vector<GLMesh>& scene, Primitive primitive);
+void UFinishSceneMesh(GLMesh& mesh);
+const char* USceneString(const char* text, size_t length);
+bool UWriteSceneText(const char* path, const vector<GLMesh>& scene);
+bool UWriteSceneBinary(const char* path, const vector<GLMesh>& scene);
+void UBenchmarkScene();
 void UTranslator(GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
-void URenderScene(vector<GLMesh> world);
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+GeometryKey UGeometryKey(const GLMesh& mesh);
+bool UAcquireCachedGeometry(GLMesh& mesh);
+void UUploadGeometry(GLMesh& mesh);
+void USetVertexAttributes(GLuint vbo);
+void UApplyVertexFormat(const VertexFormat& format);
+void UPackVertices(const float* vertices, GLuint nVertices, const VertexFormat& format, unsigned char* out);
+float UPackedNormalError(const GLMesh& mesh);
+void UCreateGeometryArena(GLuint vertexCapacity, GLuint indexCapacity);
+void UDestroyGeometryArena();
+bool UArenaAllocate(vector<ArenaRange>& freeList, GLuint count, GLuint& first);
+void UArenaFree(vector<ArenaRange>& freeList, GLuint first, GLuint count);
+GLuint UArenaUsed(const vector<ArenaRange>& freeList, GLuint capacity);
+GLuint UGrowBuffer(GLuint buffer, GLsizeiptr oldBytes, GLsizeiptr newBytes);
+void UGrowArena(GLuint minVertices, GLuint minIndices);
+void UBuildDrawList(const vector<GLMesh>& world, vector<GLDrawItem>& drawList);
+void UAddLodLevels(vector<GLMesh>& scene);
+void UComputeBounds(GLMesh& mesh);
+void UCullDrawList(const glm::mat4& viewProjection);
+void UFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+float UHalfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+void UBuildBvh(Bvh& bvh);
+void UBvhFitNode(Bvh& bvh, GLuint n);
+void URefitBvh(Bvh& bvh);
+void UBvhUpdateItem(Bvh& bvh, GLuint item, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+bool UBoxInFrustum(const glm::vec4 planes[6], unsigned planeMask, const glm::vec3& boundsMin, const glm::vec3& boundsMax, unsigned& insideMask);
+void UBvhCullFrustum(const Bvh& bvh, const glm::vec4 planes[6], vector<unsigned char>& visible);
+void UBvhQueryBox(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, vector<GLuint>& hits);
+void UBenchmarkBvh();
+void UBuildPickGeometry(const GLMesh& mesh);
+void UCursorRay(double x, double y, int width, int height, const glm::mat4& viewProjection, glm::vec3& origin, glm::vec3& direction);
+bool URayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float maxDistance, float& entry);
+bool URayTriangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& distance);
+float URayPickGeometry(const PickGeometry& pick, const glm::vec3& origin, const glm::vec3& direction, float nearest);
+bool UPickRay(const vector<GLMesh>& world, const glm::vec3& origin, const glm::vec3& direction, PickHit& hit);
+void UPickAtCursor(GLFWwindow* window);
+glm::mat4 UProjectionMatrix();
+void UCullBoundsScalar(const glm::vec4 planes[6], GLuint first, GLuint count);
+bool UBoundsInFrustum(const glm::vec4 planes[6], GLuint i);
+void USelectLods(vector<GLDrawItem>& drawList, const glm::mat4& view, const glm::mat4& projection, int viewportHeight);
+size_t UMeshResidentBytes(const GLMesh& mesh);
+size_t UPickResidentBytes(const PickGeometry& pick);
+void UReportSceneMemory(const vector<GLMesh>& world, const vector<GLDrawItem>& drawList);
+void URenderScene(vector<GLDrawItem>& drawList);
+Material UEffectiveMaterial(const GLDrawItem& item);
+uint64_t UMakeSortKey(const GLDrawItem& item, Material material, float depth);
+void UBuildRenderQueue(const vector<GLDrawItem>& drawList, const glm::mat4& view);
+#ifdef X86_SIMD
+void UCullBoundsSSE(const glm::vec4 planes[6], GLuint first, GLuint count);
+#endif
+void URadixSortRenderQueue(vector<RenderQueueEntry>& queue, vector<RenderQueueEntry>& scratch);
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLShaderProgram& program);
+void UResolveUniforms(GLShaderProgram& program);
+GLint UGetUniformLocation(GLuint programId, const char* name);
+void USetUniform(GLint location, float value);
+void USetUniform(GLint location, const glm::vec2& value);
+void USetUniform(GLint location, const glm::vec3& value);
+void USetUniform(GLint location, const glm::mat4& value);
 void UDestroyShaderProgram(GLuint programId);
-void UBuildCone(GLMesh& mesh);
-void UBuildPlane(GLMesh& mesh);
-void UBuildCube(GLMesh& mesh);
-void UBuildHollowCylinder(GLMesh& mesh);
-void UBuildCylinder(GLMesh& mesh);
-void UBuildCircle(GLMesh& mesh);
+void UCreateFrameUniformBuffer();
+void UCreateInstanceBuffer();
+void UFillInstances(const vector<GLDrawItem>& drawList);
+void UUploadInstances();
+GLuint UBatchEnd(const vector<GLDrawItem>& drawList, GLuint first);
+void URenderPerMesh(const vector<GLDrawItem>& drawList);
+void UBuildIndirectCommands(const vector<GLDrawItem>& drawList);
+void URenderIndirect();
+void UDestroyInstanceBuffer();
+void UUpdateFrameUniformBuffer(const glm::mat4& view, const glm::mat4& projection);
+void UDestroyFrameUniformBuffer();
+void UReportFrameStats(float currentTime);
+void USetFramePacing(FramePacing mode);
+void UWaitUntil(double deadline);
+void UPaceFrame();
+void UWaitForEvents();
+void UReportIdleStats(double currentTime, bool drew);
+void UWindowRefresh(GLFWwindow* window);
+void UGenerateScene(vector<GLMesh>& scene);
+void UUploadScene(vector<GLMesh>& scene);
+GLuint UParallelFor(GLuint count, const function<void(GLuint)>& body);
+void UMarkStartupPhase(const string& name);
+void UReportStartupPhases();
+void UBuildMesh(GLMesh& mesh);
+MeshOptimizeStats UGenerateGeometry(GLMesh& mesh);
+MeshOptimizeStats UOptimizeMesh(vector<float>& vertices, GLuint floatsPerVertex, vector<GLuint>& indices, bool reorderTriangles);
+float UCacheMissRatio(const vector<GLuint>& indices, GLuint nVertices, GLuint cacheSize);
+void UOptimizeVertexCache(vector<GLuint>& indices, GLuint nVertices);
+void UOptimizeOverdraw(vector<GLuint>& indices, const vector<float>& vertices, GLuint floatsPerVertex, GLuint cacheSize);
+void UOptimizeVertexFetch(vector<float>& vertices, GLuint floatsPerVertex, vector<GLuint>& indices);
+void UGeneratePlane(GLMesh& mesh);
+void UGenerateCube(GLMesh& mesh);
+void UGenerateCone(GLMesh& mesh);
+void UGenerateHollowCylinder(GLMesh& mesh);
+void UGenerateCylinder(GLMesh& mesh);
+void UGenerateCircle(GLMesh& mesh);
+void UBenchmarkGenerators();
+void UReferenceRingTriangles(const GLMesh& mesh, vector<glm::vec3>& triangles);
+void URasterizeCoverage(const vector<glm::vec3>& triangles, const glm::vec3& direction, const glm::vec2& origin, float pixelSize, vector<GLuint>& coverage);
+bool UCheckGeneratorCoverage();
+void UCreateOffscreenTarget(int width, int height);
+void UDestroyOffscreenTarget();
+void UStartCameraPath();
+void UScriptedCamera(GLuint frame, GLuint nFrames);
+void UReportHeadlessRun(vector<double>& frameTimes);
+bool USaveScreenshot(const char* path, int width, int height);
+void UReadFrame(vector<unsigned char>& pixels, int width, int height);
+GLuint UCompareUnculledFrame(vector<unsigned char>& culled, vector<unsigned char>& unculled);
+const RingTable& URingTable(float sides);
+VertexWriter UBeginVertices(GLMesh& mesh, GLuint nVertices, GLuint nIndices);
+void UPutVertex(VertexWriter& out, float x, float y, float z, float nx, float ny, float nz, float u, float v);
+void UPutTriangle(VertexWriter& out, GLuint a, GLuint b, GLuint c);
+void UEndVertices(const GLMesh& mesh, const VertexWriter& out);
+void UPutRing(VertexWriter& out, const RingTable& ring, GLuint first, GLuint count, const RingSpec& shape);
+void URingKernelScalar(const float* cosines, const float* sines, GLuint first, GLuint count, const RingSpec& spec, float batch[6][RING_BATCH]);
+void USelectRingKernel();
 void flipImageVertically(unsigned char* image, int width, int height, int channels);
 void UCreateLightMesh(GLightMesh& lightMesh);
 
 // texture create
-bool UCreateTexture(const char* filename, GLuint& textureId);
+bool UCreateTextureArray(const vector<const char*>& filenames, GLuint& textureId);
+void UResampleImage(const unsigned char* pixels, int width, int height, int newWidth, int newHeight, vector<unsigned char>& resampled);
 void UDestroyTexture(GLuint textureId);
 
+#ifdef PROFILER
+void UCreateProfiler();
+void UDestroyProfiler();
+double UProfileNow();
+void UProfileRecord(const char* name, double start, double duration, bool gpu);
+void UProfileNewFrame();
+void UBeginGpuScope(const char* name);
+void UEndGpuScope();
+bool UWriteProfileTrace(const char* path);
+
+// Times the block it is declared in
+struct ProfileScope
+{
+    const char* name;
+    double start;
+
+    ProfileScope(const char* scopeName) : name(scopeName), start(UProfileNow()) {}
+    ~ProfileScope() { UProfileRecord(name, start, UProfileNow() - start, false); }
+};
+
+// Times the GPU work issued in the block it is declared in. GL timer queries
+// cannot nest, so neither can these.
+struct GpuProfileScope
+{
+    GpuProfileScope(const char* name) { UBeginGpuScope(name); }
+    ~GpuProfileScope() { UEndGpuScope(); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#endif
+
 //---------------------------------------------------------------------------- SHADERS -----------------------------------------------------------------------------------------------------
 
 
@@ -222,10 +1116,28 @@ out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate; //outgoing texture coordinate
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Per-instance data, read from the instance buffer once per mesh drawn
+layout(location = 3) in mat4 model; // takes locations 3 - 6
+layout(location = 7) in float instanceTransparency;
+layout(location = 8) in vec2 instanceUVScale;
+layout(location = 9) in float instanceTextureLayer;
+
+flat out float transparency; // passed through to the fragment shader
+flat out vec2 uvScale;
+flat out float textureLayer;
+
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
 
 void main()
 {
@@ -233,6 +1145,9 @@ void main()
     vertexFragmentPos = vec3(model * vec4(position, 1.0f));
     vertexNormal = mat3(transpose(inverse(model))) * normal;
     vertexTextureCoordinate = textureCoordinate;
+    transparency = instanceTransparency;
+    uvScale = instanceUVScale;
+    textureLayer = instanceTextureLayer;
 }
 );
 
@@ -245,18 +1160,25 @@ in vec2 vertexTextureCoordinate; // for texture coordinates, not color
 
 out vec4 fragmentColor;
 
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 keyLightColor;
-uniform vec3 ambientLightColor;
-uniform vec3 lightPos;
-uniform vec3 keyLightPos;
-uniform vec3 viewPosition;
-
-uniform float transparency;
-
-uniform sampler2D uTexture;
-uniform vec2 uvScale;
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
+
+flat in float transparency;
+
+// Every image of the scene, one per layer; each instance samples its own
+uniform sampler2DArray uTexture;
+flat in vec2 uvScale;
+flat in float textureLayer;
 
 void main()
 {
@@ -289,7 +1211,7 @@ void main()
     vec3 keySpecular = specularIntensity * keySpecularComponent * keyLightColor;
 
     // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate * uvScale, textureLayer));
 
     // Calculate phong result
     vec3 phong = (ambient + diffuse + keyDiffuse + specular + keySpecular) * textureColor.xyz;
@@ -315,10 +1237,28 @@ out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate; //outgoing texture coordinate
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Per-instance data, read from the instance buffer once per mesh drawn
+layout(location = 3) in mat4 model; // takes locations 3 - 6
+layout(location = 7) in float instanceTransparency;
+layout(location = 8) in vec2 instanceUVScale;
+layout(location = 9) in float instanceTextureLayer;
+
+flat out float transparency; // passed through to the fragment shader
+flat out vec2 uvScale;
+flat out float textureLayer;
+
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
 
 void main()
 {
@@ -326,6 +1266,9 @@ void main()
     vertexFragmentPos = vec3(model * vec4(position, 1.0f));
     vertexNormal = mat3(transpose(inverse(model))) * normal;
     vertexTextureCoordinate = textureCoordinate;
+    transparency = instanceTransparency;
+    uvScale = instanceUVScale;
+    textureLayer = instanceTextureLayer;
 }
 );
 
@@ -338,18 +1281,25 @@ in vec2 vertexTextureCoordinate; // for texture coordinates, not color
 
 out vec4 fragmentColor;
 
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 keyLightColor;
-uniform vec3 ambientLightColor;
-uniform vec3 lightPos;
-uniform vec3 keyLightPos;
-uniform vec3 viewPosition;
-
-uniform float transparency;
-
-uniform sampler2D uTexture;
-uniform vec2 uvScale;
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
+
+flat in float transparency;
+
+// Every image of the scene, one per layer; each instance samples its own
+uniform sampler2DArray uTexture;
+flat in vec2 uvScale;
+flat in float textureLayer;
 
 void main()
 {
@@ -382,7 +1332,7 @@ void main()
     vec3 keySpecular = specularIntensity * keySpecularComponent * keyLightColor;
 
     // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate * uvScale, textureLayer));
 
     // Calculate phong result
     vec3 phong = (ambient + diffuse + keyDiffuse + specular + keySpecular) * textureColor.xyz;
@@ -408,10 +1358,28 @@ out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate; //outgoing texture coordinate
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Per-instance data, read from the instance buffer once per mesh drawn
+layout(location = 3) in mat4 model; // takes locations 3 - 6
+layout(location = 7) in float instanceTransparency;
+layout(location = 8) in vec2 instanceUVScale;
+layout(location = 9) in float instanceTextureLayer;
+
+flat out float transparency; // passed through to the fragment shader
+flat out vec2 uvScale;
+flat out float textureLayer;
+
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
 
 void main()
 {
@@ -419,6 +1387,9 @@ void main()
     vertexFragmentPos = vec3(model * vec4(position, 1.0f));
     vertexNormal = mat3(transpose(inverse(model))) * normal;
     vertexTextureCoordinate = textureCoordinate;
+    transparency = instanceTransparency;
+    uvScale = instanceUVScale;
+    textureLayer = instanceTextureLayer;
 }
 );
 
@@ -431,18 +1402,25 @@ in vec2 vertexTextureCoordinate; // for texture coordinates, not color
 
 out vec4 fragmentColor;
 
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 keyLightColor;
-uniform vec3 ambientLightColor;
-uniform vec3 lightPos;
-uniform vec3 keyLightPos;
-uniform vec3 viewPosition;
-
-uniform float transparency;
-
-uniform sampler2D uTexture;
-uniform vec2 uvScale;
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
+
+flat in float transparency;
+
+// Every image of the scene, one per layer; each instance samples its own
+uniform sampler2DArray uTexture;
+flat in vec2 uvScale;
+flat in float textureLayer;
 
 void main()
 {
@@ -475,7 +1453,7 @@ void main()
     vec3 keySpecular = specularIntensity * keySpecularComponent * keyLightColor;
 
     // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate * uvScale, textureLayer));
 
     // Calculate phong result
     vec3 phong = (ambient + diffuse + keyDiffuse + specular + keySpecular) * textureColor.xyz;
@@ -501,10 +1479,28 @@ out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate; //outgoing texture coordinate
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Per-instance data, read from the instance buffer once per mesh drawn
+layout(location = 3) in mat4 model; // takes locations 3 - 6
+layout(location = 7) in float instanceTransparency;
+layout(location = 8) in vec2 instanceUVScale;
+layout(location = 9) in float instanceTextureLayer;
+
+flat out float transparency; // passed through to the fragment shader
+flat out vec2 uvScale;
+flat out float textureLayer;
+
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
 
 void main()
 {
@@ -512,6 +1508,9 @@ void main()
     vertexFragmentPos = vec3(model * vec4(position, 1.0f));
     vertexNormal = mat3(transpose(inverse(model))) * normal;
     vertexTextureCoordinate = textureCoordinate;
+    transparency = instanceTransparency;
+    uvScale = instanceUVScale;
+    textureLayer = instanceTextureLayer;
 }
 );
 
@@ -524,24 +1523,31 @@ in vec2 vertexTextureCoordinate; // for texture coordinates, not color
 
 out vec4 fragmentColor;
 
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 keyLightColor;
-uniform vec3 ambientLightColor;
-uniform vec3 lightPos;
-uniform vec3 keyLightPos;
-uniform vec3 viewPosition;
-
-uniform float transparency;
-
-uniform sampler2D uTexture;
-uniform vec2 uvScale;
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
+
+flat in float transparency;
+
+// Every image of the scene, one per layer; each instance samples its own
+uniform sampler2DArray uTexture;
+flat in vec2 uvScale;
+flat in float textureLayer;
 
 void main()
 {
     //Ambient/diffuse light is not calculated for glowing objects
     //Specular is still calculated to allow other light sources to reflect off of the glowing object
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate * uvScale, textureLayer));
 
     //Calculate Specular lighting*/
     vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
@@ -583,8 +1589,19 @@ const GLchar* lampVertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+// Per-frame camera and light data shared by every program through one uniform buffer
+layout(std140, binding = 0) uniform FrameBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 lightColor;
+    vec3 lightPos;
+    vec3 keyLightColor;
+    vec3 keyLightPos;
+    vec3 ambientLightColor;
+    vec3 viewPosition;
+};
 
 void main()
 {
@@ -612,73 +1629,317 @@ void main()
 
 int main(int argc, char* argv[])
 {
+    // --compile-scene in out writes a scene in the binary form, and
+    // --bench-scene times loading both forms; neither needs a window
+    if (argc > 3 && strcmp(argv[1], "--compile-scene") == 0)
+    {
+        vector<GLMesh> compiled;
+        if (!ULoadScene(argv[2], compiled))
+            return EXIT_FAILURE;
+        if (!UWriteSceneBinary(argv[3], compiled))
+        {
+            cout << "Failed to write scene " << argv[3] << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "INFO: Compiled " << compiled.size() << " objects from " << argv[2] << " to " << argv[3] << endl;
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-scene") == 0)
+    {
+        UBenchmarkScene();
+        return EXIT_SUCCESS;
+    }
+
+    // --check-geometry rasterizes the round shapes against the triangles they
+    // were drawn with before indexing, on the CPU
+    if (argc > 1 && strcmp(argv[1], "--check-geometry") == 0)
+    {
+        USelectRingKernel();
+        return UCheckGeneratorCoverage() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
-    // Create the mesh
-    UBuildScene(scene);
+    UMarkStartupPhase("window");
 
-    // Create Light Object
+    // Widest SIMD kernel this CPU runs, used by the round shape generators
+    USelectRingKernel();
+
+#ifdef PROFILER
+    UCreateProfiler();
+#endif
+
+    // --per-mesh starts on the per-mesh draw loop instead of multi-draw indirect;
+    // --float-vertices uploads plain float vertices instead of the compact format
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--per-mesh") == 0)
+            gRenderPath = perMeshPath;
+        if (strcmp(argv[i], "--float-vertices") == 0)
+            gVertexFormat = &gFloatVertexFormat;
+        if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            gScenePath = argv[++i];
+        if (strcmp(argv[i], "--on-demand") == 0)
+            gOnDemand = true;
+        if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "uncapped") == 0)
+                gPacing.mode = pacingUncapped;
+            else if (strcmp(argv[i], "vsync") == 0)
+                gPacing.mode = pacingVsync;
+            else if (strcmp(argv[i], "limit") == 0)
+                gPacing.mode = pacingLimited;
+        }
+        if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+        {
+            gPacing.targetFrameTime = 1.0 / max(1.0, atof(argv[++i]));
+            gPacing.mode = pacingLimited;
+        }
+#ifdef PROFILER
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            gTracePath = argv[++i];
+            gTraceAtExit = true;
+        }
+#endif
+    }
+
+    // Every mesh vao reads its per-instance attributes from this buffer
+    UCreateInstanceBuffer();
+
+    // Static geometry is packed into the arena as it is uploaded; it grows if
+    // the scene outgrows this
+    UCreateGeometryArena(16384, 49152);
+
+    // --bench-generators times the shape generators and exits, and
+    // --bench-bvh does the same for the bounding volume hierarchy
+    if (argc > 1 && (strcmp(argv[1], "--bench-generators") == 0 || strcmp(argv[1], "--bench-bvh") == 0))
+    {
+        if (strcmp(argv[1], "--bench-generators") == 0)
+            UBenchmarkGenerators();
+        else
+            UBenchmarkBvh();
+        UDestroyGeometryArena();
+        UDestroyInstanceBuffer();
+        glfwTerminate();
+        return EXIT_SUCCESS;
+    }
+
+    // Create the mesh: load the scene file, generate its geometry on every
+    // core, then upload it here on the context thread
+    if (!ULoadScene(gScenePath, scene))
+        return EXIT_FAILURE;
+    UAddLodLevels(scene);
+    UMarkStartupPhase("load scene");
+
+    UGenerateScene(scene);
+    UUploadScene(scene);
+
+    // Create Light Object
     UCreateLightMesh(spotLightMesh);
     UCreateLightMesh(keyLightMesh);
 
     // Create the shader programs
-    if (!UCreateShaderProgram(vertexShaderSourceMatte, fragmentShaderSourceMatte, gProgramIdMatte))
+    if (!UCreateShaderProgram(vertexShaderSourceMatte, fragmentShaderSourceMatte, gProgramMatte))
         return EXIT_FAILURE;
 
-    if (!UCreateShaderProgram(vertexShaderSourceSatin, fragmentShaderSourceSatin, gProgramIdSatin))
+    if (!UCreateShaderProgram(vertexShaderSourceSatin, fragmentShaderSourceSatin, gProgramSatin))
         return EXIT_FAILURE;
 
-    if (!UCreateShaderProgram(vertexShaderSourceGloss, fragmentShaderSourceGloss, gProgramIdGloss))
+    if (!UCreateShaderProgram(vertexShaderSourceGloss, fragmentShaderSourceGloss, gProgramGloss))
         return EXIT_FAILURE;
 
-    if (!UCreateShaderProgram(vertexShaderSourceGlow, fragmentShaderSourceGlow, gProgramIdGlow))
+    if (!UCreateShaderProgram(vertexShaderSourceGlow, fragmentShaderSourceGlow, gProgramGlow))
         return EXIT_FAILURE;   
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLightProgramId))
+    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLightProgram))
         return EXIT_FAILURE;
 
+    // Create the uniform buffer shared by all the programs
+    UCreateFrameUniformBuffer();
+
+    UMarkStartupPhase("shaders");
+
+    // Each image becomes one layer of the scene's array texture; meshes using
+    // the same image share its layer
+    map<string, GLuint> textureLayers;
+    vector<const char*> textureFiles;
 
     for (auto& m : scene)
     {
-        if (!UCreateTexture(m.texFilename, m.textureId))
+        auto layer = textureLayers.find(m.texFilename);
+        if (layer == textureLayers.end())
         {
-            cout << "Failed to load texture " << m.texFilename << endl;
-            //cin.get();
-            return EXIT_FAILURE;
-
+            layer = textureLayers.emplace(m.texFilename, textureFiles.size()).first;
+            textureFiles.push_back(m.texFilename);
         }
-
+        m.textureLayer = layer->second;
     }
 
+    if (!UCreateTextureArray(textureFiles, gSceneTextures))
+        return EXIT_FAILURE;
+
+    UMarkStartupPhase("textures");
+
+    // Everything the render loop needs is captured once, here
+    UBuildDrawList(scene, gDrawList);
+    UMarkStartupPhase("draw list");
+
+    UReportStartupPhases();
+    UReportSceneMemory(scene, gDrawList);
+
     // Background window color set to black
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+#ifdef _DEBUG
+    // The first frame may allocate: drivers build shader variants lazily on first use
+    bool firstFrame = true;
+#endif
+
+    // headless runs time every frame of the camera path
+    const bool headless = gHeadlessFrames > 0;
+    vector<double> frameTimes;
+    frameTimes.reserve(gHeadlessFrames);
+
+    // frames read back by --check-culling, and how many came out different
+    vector<unsigned char> culledPixels, unculledPixels;
+    GLuint framesDiffering = 0, mostPixelsDiffering = 0;
+    if (gCheckCulling)
+    {
+        culledPixels.resize(WINDOW_WIDTH * WINDOW_HEIGHT * 3);
+        unculledPixels.resize(WINDOW_WIDTH * WINDOW_HEIGHT * 3);
+    }
+    GLuint frame = 0;
+    if (headless)
+        UStartCameraPath();
+
+    // headless frames are timed, so they never wait
+    USetFramePacing(headless ? pacingUncapped : gPacing.mode);
+
+    // on demand, a drawn frame is followed by one more look at the input
+    // before sleeping, since keys held down send no events
+    bool drewLastFrame = true;
+
     // render loop
     // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    while (headless ? frame < gHeadlessFrames : !glfwWindowShouldClose(gWindow))
     {
+#ifdef PROFILER
+        UProfileNewFrame();
+#endif
+        PROFILE_SCOPE("frame");
+
+        if (!headless)
+        {
+            if (gOnDemand && !gRedrawNeeded && !gSpotLightOrbit && !drewLastFrame)
+            {
+                PROFILE_SCOPE("waiting");
+                UWaitForEvents();
+            }
 
+            PROFILE_SCOPE("pacing");
+            UPaceFrame();
+        }
 
         float currentFrame = glfwGetTime();
         gDeltaTime = currentFrame - gLastFrame;
         gLastFrame = currentFrame;
 
-        // input
+        gFrameStats = FrameStats();
+
+#ifdef _DEBUG
+        const size_t allocationsBefore = gAllocationCount;
+#endif
+
+        // input, or the next step along the camera path. Events are polled
+        // here, just before drawing, so the frame shows the newest input.
         // -----
-        UProcessInput(gWindow);
+        {
+            PROFILE_SCOPE("input");
+            if (headless)
+            {
+                gDeltaTime = HEADLESS_FRAME_TIME;
+                UScriptedCamera(frame, gHeadlessFrames);
+            }
+            else
+            {
+                glfwPollEvents();
+                UProcessInput(gWindow);
+            }
+        }
+
+        // on demand, a frame where nothing changed is not drawn
+        drewLastFrame = headless || !gOnDemand || gRedrawNeeded || gSpotLightOrbit;
+        if (!drewLastFrame)
+        {
+            UReportIdleStats(glfwGetTime(), false);
+            continue;
+        }
+        gRedrawNeeded = false;
 
         // Render this frame
-        URenderScene(scene);
+        URenderScene(gDrawList);
+
+#ifdef _DEBUG
+        assert((firstFrame || gAllocationCount == allocationsBefore) && "the frame loop must not allocate");
+        firstFrame = false;
+#endif
+
+        UReportFrameStats(currentFrame);
+        if (gOnDemand && !headless)
+            UReportIdleStats(glfwGetTime(), true);
 
+#ifdef PROFILER
+        // writing allocates, so it waits until the frame's own work is checked
+        if (gTraceRequested)
+        {
+            gTraceRequested = false;
+            UWriteProfileTrace(gTracePath);
+        }
+#endif
 
+        if (headless)
+        {
+            // wait for the GPU so each time covers the whole frame
+            glFinish();
+            frameTimes.push_back(glfwGetTime() - currentFrame);
+            frame++;
+
+            if (gCheckCulling)
+            {
+                const GLuint differing = UCompareUnculledFrame(culledPixels, unculledPixels);
+                framesDiffering += differing > 0;
+                mostPixelsDiffering = max(mostPixelsDiffering, differing);
+            }
+        }
+    }
 
-        glfwPollEvents();
+    int exitCode = EXIT_SUCCESS;
+    if (gCheckCulling)
+    {
+        cout << "CHECK: culling on and off, " << gHeadlessFrames << " frames: " << framesDiffering << " differ";
+        if (framesDiffering > 0)
+            cout << " (up to " << mostPixelsDiffering << " pixels)";
+        cout << " | " << gCullMismatches << " box tests disagree with the scalar one" << endl;
+        if (framesDiffering > 0 || gCullMismatches > 0)
+            exitCode = EXIT_FAILURE;
+    }
 
-        //Add time delay before starting next loop
-        Sleep(40);
+    if (headless)
+    {
+        UReportHeadlessRun(frameTimes);
+        if (gScreenshotPath && !USaveScreenshot(gScreenshotPath, WINDOW_WIDTH, WINDOW_HEIGHT))
+            cout << "Failed to save screenshot " << gScreenshotPath << endl;
+        UDestroyOffscreenTarget();
     }
 
+#ifdef PROFILER
+    if (gTraceAtExit)
+        UWriteProfileTrace(gTracePath);
+    UDestroyProfiler();
+#endif
+
     for (auto& m : scene)
     {
         UDestroyMesh(m);
@@ -688,22 +1949,45 @@ int main(int argc, char* argv[])
 
 
     // Release shader program
-    UDestroyShaderProgram(gProgramIdMatte);
-    UDestroyShaderProgram(gProgramIdSatin);
-    UDestroyShaderProgram(gProgramIdGloss);
-    UDestroyShaderProgram(gProgramIdGlow);
-    UDestroyShaderProgram(gLightProgramId);
+    UDestroyShaderProgram(gProgramMatte.id);
+    UDestroyShaderProgram(gProgramSatin.id);
+    UDestroyShaderProgram(gProgramGloss.id);
+    UDestroyShaderProgram(gProgramGlow.id);
+    UDestroyShaderProgram(gLightProgram.id);
 
+    UDestroyFrameUniformBuffer();
+    UDestroyGeometryArena();
+    UDestroyInstanceBuffer();
+    UDestroyTexture(gSceneTextures);
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+
+    exit(exitCode); // Terminates the program, successfully unless a check failed
 }
 
 
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
+    // the headless flags decide how the context is made, so they are read here
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+            gHeadlessFrames = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc)
+            gScreenshotPath = argv[++i];
+        else if (strcmp(argv[i], "--check-culling") == 0)
+            gCheckCulling = true;
+    }
+    if (gCheckCulling && gHeadlessFrames == 0)
+        gHeadlessFrames = 120;
+
     // GLFW: initialize and configure
     // ------------------------------
+#ifdef GLFW_PLATFORM_NULL
+    // no display server needed (GLFW 3.4)
+    if (gHeadlessFrames > 0)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
@@ -713,9 +1997,25 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
+    // headless runs draw offscreen, so the window is never shown and the
+    // context comes from EGL, which runs surfaceless on Mesa's llvmpipe
+    if (gHeadlessFrames > 0)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+    }
+
     // GLFW: window creation
     // ---------------------
     * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+
+    // builds without EGL may still have OSMesa
+    if (*window == NULL && gHeadlessFrames > 0)
+    {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+        *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    }
+
     if (*window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
@@ -723,11 +2023,21 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
         return false;
     }
     glfwMakeContextCurrent(*window);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
 
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    // nobody is there to give input in headless runs
+    if (gHeadlessFrames == 0)
+    {
+        glfwSetCursorPosCallback(*window, UMousePositionCallback);
+        glfwSetScrollCallback(*window, UMouseScrollCallback);
+        glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+        glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+        glfwSetWindowRefreshCallback(*window, UWindowRefresh);
+
+        int framebufferWidth;
+        glfwGetFramebufferSize(*window, &framebufferWidth, &gViewportHeight);
+
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
 
     // GLEW: initialize
@@ -736,6 +2046,9 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glewExperimental = GL_TRUE;
     GLenum GlewInitResult = glewInit();
 
+    if (gHeadlessFrames > 0)
+        UCreateOffscreenTarget(WINDOW_WIDTH, WINDOW_HEIGHT);
+
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glEnable(GL_BLEND);
     //glDisable(GL_CULL_FACE);
@@ -760,13 +2073,18 @@ void UProcessInput(GLFWwindow* window)
         glfwSetWindowShouldClose(window, true);
 
     // draw lines
-    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
+    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
         glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        gRedrawNeeded = true;
+    }
 
     // fill shapes
-    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
+    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        gRedrawNeeded = true;
+    }
 
+    const glm::vec3 cameraPosition = gCamera.Position;
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
         gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
@@ -779,7 +2097,11 @@ void UProcessInput(GLFWwindow* window)
         gCamera.ProcessKeyboard(UP, gDeltaTime);
     if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
         gCamera.ProcessKeyboard(DOWN, gDeltaTime);
+    if (gCamera.Position != cameraPosition)
+        gRedrawNeeded = true;
 
+    // every toggle below changes what is drawn, or is cheap to redraw for
+    const bool wasKeyDown = keyDown;
 
     //Process input from toggle keys. keyDown variable used to prevent
     //rapid swapping if the key is held
@@ -789,7 +2111,7 @@ void UProcessInput(GLFWwindow* window)
             isPerspective = !isPerspective;
         }
     }
-    else if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) {
+    else if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS && !lightSources.empty()) {
         if (keyDown == false) {
             keyDown = true;
             lightSources[0] = !lightSources[0];
@@ -821,10 +2143,36 @@ void UProcessInput(GLFWwindow* window)
         }      
 
     }
+    // switch between the per-mesh and multi-draw indirect render paths
+    else if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
+        if (keyDown == false) {
+            keyDown = true;
+            gRenderPath = gRenderPath == indirectPath ? perMeshPath : indirectPath;
+        }
+    }
+    // next frame pacing mode
+    else if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS) {
+        if (keyDown == false) {
+            keyDown = true;
+            USetFramePacing(FramePacing((gPacing.mode + 1) % 3));
+        }
+    }
+#ifdef PROFILER
+    // write the profile recorded so far
+    else if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS) {
+        if (keyDown == false) {
+            keyDown = true;
+            gTraceRequested = true;
+        }
+    }
+#endif
     else {
         keyDown = false;
     }
 
+    if (keyDown && !wasKeyDown)
+        gRedrawNeeded = true;
+
    
 
 
@@ -846,11 +2194,20 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
     gLastY = ypos;
 
     gCamera.ProcessMouseMovement(xoffset, yoffset);
+    gRedrawNeeded = true;
 }
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
     // change camera speed by mouse scroll
     gCamera.ProcessMouseScroll(yoffset);
+    gRedrawNeeded = true;
+}
+
+// left click picks the object under the cursor
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        UPickAtCursor(window);
 }
 
 
@@ -858,1377 +2215,4497 @@ void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
+    gViewportHeight = height;
+    gRedrawNeeded = true;
 }
 
-void URenderScene(vector<GLMesh> world)
+// the window was uncovered or otherwise needs its contents drawn again
+void UWindowRefresh(GLFWwindow* window)
 {
+    gRedrawNeeded = true;
+}
 
-    // Borrowed from the Tutorial; animates the Spot Light to circle around the scene
-    constexpr float angularVelocity = glm::radians(45.0f);
-    if (gSpotLightOrbit)
+// Captures the per-frame state of every mesh into a compact draw list and
+// sizes the render queue for it, so rendering a frame allocates nothing
+void UBuildDrawList(const vector<GLMesh>& world, vector<GLDrawItem>& drawList)
+{
+    drawList.clear();
+    drawList.reserve(world.size());
+    gLodLevels.clear();
+    gCullBounds = CullBounds();
+
+    // coarser levels of each mesh
+    vector<vector<GLuint>> lods(world.size());
+    for (GLuint i = 0; i < world.size(); i++)
     {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gSpotLightPosition, 1.0f);
-        gSpotLightPosition.x = newPosition.x;
-        gSpotLightPosition.y = newPosition.y;
-        gSpotLightPosition.z = newPosition.z;
+        if (world[i].lodOf >= 0)
+            lods[world[i].lodOf].push_back(i);
     }
 
+    for (GLuint i = 0; i < world.size(); i++)
+    {
+        const GLMesh& mesh = world[i];
+        if (mesh.lodOf >= 0)
+            continue;
+
+        GLDrawItem item;
+        item.model = mesh.model;
+        item.uvScale = mesh.gUVScale;
+        item.transparency = mesh.transparency;
+        item.vao = mesh.vao;
+        item.geometryId = mesh.geometryId;
+        item.baseVertex = mesh.baseVertex;
+        item.firstIndex = mesh.firstIndex;
+        item.nIndices = mesh.nIndices;
+        item.indexType = mesh.indexType;
+        item.textureLayer = mesh.textureLayer;
+        item.lightSourceId = mesh.lightSourceId;
+        item.material = mesh.material;
+
+        // the model matrix scales the local sphere by at most its longest axis
+        const glm::vec3 centre = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+        item.boundsCentre = glm::vec3(mesh.model * glm::vec4(centre, 1.0f));
+        item.boundsRadius = mesh.boundsRadius * max(glm::length(glm::vec3(mesh.model[0])),
+            max(glm::length(glm::vec3(mesh.model[1])), glm::length(glm::vec3(mesh.model[2]))));
+
+        // the box stays a box around the mesh once each world axis takes the
+        // extent of every local axis it is built from (Arvo)
+        const glm::vec3 extent = (mesh.boundsMax - mesh.boundsMin) * 0.5f;
+        glm::vec3 worldExtent(0.0f);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (int local = 0; local < 3; local++)
+                worldExtent[axis] += fabsf(mesh.model[local][axis]) * extent[local];
+        }
 
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+        gCullBounds.centreX.push_back(item.boundsCentre.x);
+        gCullBounds.centreY.push_back(item.boundsCentre.y);
+        gCullBounds.centreZ.push_back(item.boundsCentre.z);
+        gCullBounds.extentX.push_back(worldExtent.x);
+        gCullBounds.extentY.push_back(worldExtent.y);
+        gCullBounds.extentZ.push_back(worldExtent.z);
+
+        // levels coarsest first, ending with the mesh itself, which is drawn
+        // until the first USelectLods
+        item.lodFirst = gLodLevels.size();
+        item.lodCount = 0;
+        item.lod = 0;
+        if (!lods[i].empty())
+        {
+            lods[i].push_back(i);
+            sort(lods[i].begin(), lods[i].end(),
+                [&](GLuint a, GLuint b) { return world[a].number_of_sides < world[b].number_of_sides; });
+
+            for (GLuint level : lods[i])
+            {
+                const GLMesh& lod = world[level];
+                gLodLevels.push_back({ lod.number_of_sides, lod.vao, lod.geometryId, lod.baseVertex, lod.firstIndex, lod.nIndices, lod.indexType });
+            }
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            item.lodCount = lods[i].size();
+            item.lod = item.lodCount - 1;
+        }
 
+        drawList.push_back(item);
+    }
 
-    // transform the camera (x, y, z)
-    glm::mat4 view = gCamera.GetViewMatrix();
+    gRenderQueue.reserve(drawList.size());
+    gRenderQueueScratch.reserve(drawList.size());
 
+    // pad the culling arrays to whole batches with empty boxes
+    const GLuint padded = (drawList.size() + CULL_BATCH - 1) / CULL_BATCH * CULL_BATCH;
+    for (vector<float>* component : { &gCullBounds.centreX, &gCullBounds.centreY, &gCullBounds.centreZ,
+        &gCullBounds.extentX, &gCullBounds.extentY, &gCullBounds.extentZ })
+        component->resize(padded, 0.0f);
+    gVisible.assign(padded, 1);
 
-    //Create a projection depending on whether we are set to perspective or orthographic
-    glm::mat4 projection;
-    if (isPerspective)
+    // and the same boxes in a hierarchy, for culling big scenes and for queries
+    gSceneBvh = Bvh();
+    for (GLuint i = 0; i < drawList.size(); i++)
     {
-        // p for perspective (default)
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+        const glm::vec3 centre(gCullBounds.centreX[i], gCullBounds.centreY[i], gCullBounds.centreZ[i]);
+        const glm::vec3 extent(gCullBounds.extentX[i], gCullBounds.extentY[i], gCullBounds.extentZ[i]);
+        gSceneBvh.itemMin.push_back(centre - extent);
+        gSceneBvh.itemMax.push_back(centre + extent);
     }
-    else
-        // o for ortho
-        projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
-
-
-    
-
-
-
+    UBuildBvh(gSceneBvh);
+
+    // room for every mesh to be drawn as an instance
+    gInstances.reserve(drawList.size());
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, drawList.size() * sizeof(GLInstance), nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // and for every mesh to need an indirect command and a call of its own
+    gIndirectCommands.reserve(drawList.size());
+    gIndirectGroups.reserve(drawList.size());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, drawList.size() * sizeof(DrawElementsCommand), nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
-    // loop to draw each shape individually
-    for (auto i = 0; i < world.size(); ++i)
+// Adds coarser copies of every round mesh, one per LOD_SIDES entry below
+// its own side count. They go through generation and upload like any other
+// mesh, sharing geometry through the cache, and UBuildDrawList turns them
+// into levels of detail of the original.
+void UAddLodLevels(vector<GLMesh>& scene)
+{
+    const GLuint nMeshes = scene.size();
+    for (GLuint i = 0; i < nMeshes; i++)
     {
-        auto mesh = world[i];
-
-        // activate vbo's within mesh's vao
-        glBindVertexArray(mesh.vao);
+        if (scene[i].primitive == cube || scene[i].primitive == plane)
+            continue;
 
-        switch (mesh.material)
+        for (float sides : LOD_SIDES)
         {
-        case matte:
-            gUseProgramId = gProgramIdMatte;
-            break;
-        case satin:
-            gUseProgramId = gProgramIdSatin;
-            break;
-        case gloss:
-            gUseProgramId = gProgramIdGloss;
-            break;
-        case glow:
-            if (lightSources[mesh.lightSourceId]) {
-                gUseProgramId = gProgramIdGlow;
-            }
-            else {
-                gUseProgramId = gProgramIdGloss;
-            }
-
-            break;
+            if (sides >= scene[i].number_of_sides)
+                break;
 
-        default:
-            gUseProgramId = gProgramIdMatte;
+            GLMesh lod = scene[i];
+            lod.number_of_sides = sides;
+            lod.lodOf = i;
+            scene.push_back(lod);
         }
+    }
+}
 
-        // set default shader
-        glUseProgram(gUseProgramId);
-
-        // Initializes location variables
-        GLint modelLocation = glGetUniformLocation(gUseProgramId, "model");
-        GLint viewLocation = glGetUniformLocation(gUseProgramId, "view");
-        GLint projLocation = glGetUniformLocation(gUseProgramId, "projection");
-        GLint UVScaleLoc = glGetUniformLocation(gUseProgramId, "uvScale");
-
-
-        // Spotlight
-        GLint lightColorLoc = glGetUniformLocation(gUseProgramId, "lightColor");
-        GLint lightPositionLoc = glGetUniformLocation(gUseProgramId, "lightPos");
-
-        // Key light
-        GLint keyLightColorLoc = glGetUniformLocation(gUseProgramId, "keyLightColor");
-        GLint keyLightPositionLoc = glGetUniformLocation(gUseProgramId, "keyLightPos");
+// Box around the mesh's generated vertices and the radius of the sphere
+// around its centre, for culling and picking levels of detail
+void UComputeBounds(GLMesh& mesh)
+{
+    const GLuint nVertices = mesh.v.size() / FLOATS_PER_VERTEX;
+    if (nVertices == 0)
+        return;
 
-        //Ambient light
-        GLint ambientLightLoc = glGetUniformLocation(gUseProgramId, "ambientLightColor");
+    mesh.boundsMin = mesh.boundsMax = glm::vec3(mesh.v[0], mesh.v[1], mesh.v[2]);
+    for (GLuint i = 1; i < nVertices; i++)
+    {
+        const glm::vec3 position(mesh.v[i * FLOATS_PER_VERTEX], mesh.v[i * FLOATS_PER_VERTEX + 1], mesh.v[i * FLOATS_PER_VERTEX + 2]);
+        mesh.boundsMin = glm::min(mesh.boundsMin, position);
+        mesh.boundsMax = glm::max(mesh.boundsMax, position);
+    }
 
-        // Camera view
-        GLint viewPositionLoc = glGetUniformLocation(gUseProgramId, "viewPosition");
+    // tighter than half the box diagonal for round shapes
+    const glm::vec3 centre = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    float radiusSquared = 0.0f;
+    for (GLuint i = 0; i < nVertices; i++)
+    {
+        const glm::vec3 position(mesh.v[i * FLOATS_PER_VERTEX], mesh.v[i * FLOATS_PER_VERTEX + 1], mesh.v[i * FLOATS_PER_VERTEX + 2]);
+        const glm::vec3 offset = position - centre;
+        radiusSquared = max(radiusSquared, glm::dot(offset, offset));
+    }
+    mesh.boundsRadius = sqrtf(radiusSquared);
+}
 
-        // Reference matrix uniforms from the shape shader program for the shape color, light color, light position, and camera position
-        GLint objectColorLoc = glGetUniformLocation(gUseProgramId, "objectColor");
+// Tests every draw item's world box against the view frustum and fills
+// gVisible. Big scenes walk gSceneBvh, small ones test every box.
+void UCullDrawList(const glm::mat4& viewProjection)
+{
+    if (!gCullingEnabled)
+    {
+        fill(gVisible.begin(), gVisible.end(), 1);
+        return;
+    }
 
-        GLint transparencyLoc = glGetUniformLocation(gUseProgramId, "transparency");
+    glm::vec4 planes[6];
+    UFrustumPlanes(viewProjection, planes);
 
-       
+    if (gSceneBvh.itemMin.size() >= BVH_CULL_MIN_ITEMS)
+        UBvhCullFrustum(gSceneBvh, planes, gVisible);
+    else
+    {
+#ifdef X86_SIMD
+        UCullBoundsSSE(planes, 0, gVisible.size());
+#else
+        UCullBoundsScalar(planes, 0, gVisible.size());
+#endif
+    }
 
-        // Spot Light
-        glUniform3f(lightColorLoc, gSpotLightColor.r, gSpotLightColor.g, gSpotLightColor.b);
-        glUniform3f(lightPositionLoc, gSpotLightPosition.x, gSpotLightPosition.y, gSpotLightPosition.z);
+    // the SIMD and hierarchy paths have to agree with the scalar one
+#ifdef _DEBUG
+    for (GLuint i = 0; i < gSceneBvh.itemMin.size(); i++)
+        assert(gVisible[i] == UBoundsInFrustum(planes, i));
+#endif
+    if (gCheckCulling)
+    {
+        for (GLuint i = 0; i < gSceneBvh.itemMin.size(); i++)
+            gCullMismatches += gVisible[i] != UBoundsInFrustum(planes, i);
+    }
+}
 
-        // Key Light
-        glUniform3f(keyLightColorLoc, gKeyLightColor.r, gKeyLightColor.g, gKeyLightColor.b);
-        glUniform3f(keyLightPositionLoc, gKeyLightPosition.x, gKeyLightPosition.y, gKeyLightPosition.z);
+// Normalized planes of the view frustum, facing inwards. They come out of
+// the combined matrix (Gribb & Hartmann), so this works for the perspective
+// and the ortho projection alike.
+void UFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    const glm::mat4 rows = glm::transpose(viewProjection);
+    planes[0] = rows[3] + rows[0];  // left
+    planes[1] = rows[3] - rows[0];  // right
+    planes[2] = rows[3] + rows[1];  // bottom
+    planes[3] = rows[3] - rows[1];  // top
+    planes[4] = rows[3] + rows[2];  // near
+    planes[5] = rows[3] - rows[2];  // far
+
+    for (int p = 0; p < 6; p++)
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+}
 
-        // Ambient Light
-        glUniform3f(ambientLightLoc, gAmbientLightColor.r, gAmbientLightColor.g, gAmbientLightColor.b);
+// A box is outside when it lies entirely behind one plane: its centre is
+// further behind it than the box reaches along the plane normal
+bool UBoundsInFrustum(const glm::vec4 planes[6], GLuint i)
+{
+    const CullBounds& bounds = gCullBounds;
 
+    for (int p = 0; p < 6; p++)
+    {
+        const glm::vec4& plane = planes[p];
+        const float distance = plane.x * bounds.centreX[i] + plane.y * bounds.centreY[i] + plane.z * bounds.centreZ[i] + plane.w;
+        const float reach = fabsf(plane.x) * bounds.extentX[i] + fabsf(plane.y) * bounds.extentY[i] + fabsf(plane.z) * bounds.extentZ[i];
+        if (distance + reach < 0.0f)
+            return false;
+    }
+    return true;
+}
 
-        const glm::vec3 cameraPosition = gCamera.Position;
-        glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+void UCullBoundsScalar(const glm::vec4 planes[6], GLuint first, GLuint count)
+{
+    for (GLuint i = first; i < first + count; i++)
+        gVisible[i] = UBoundsInFrustum(planes, i);
+}
 
+#ifdef X86_SIMD
+// UCullBoundsScalar for four boxes at a time; count is a multiple of 4
+void UCullBoundsSSE(const glm::vec4 planes[6], GLuint first, GLuint count)
+{
+    const CullBounds& bounds = gCullBounds;
+    const __m128 signMask = _mm_set1_ps(-0.0f);
 
+    for (GLuint i = first; i < first + count; i += 4)
+    {
+        const __m128 cx = _mm_loadu_ps(&bounds.centreX[i]);
+        const __m128 cy = _mm_loadu_ps(&bounds.centreY[i]);
+        const __m128 cz = _mm_loadu_ps(&bounds.centreZ[i]);
+        const __m128 ex = _mm_loadu_ps(&bounds.extentX[i]);
+        const __m128 ey = _mm_loadu_ps(&bounds.extentY[i]);
+        const __m128 ez = _mm_loadu_ps(&bounds.extentZ[i]);
+
+        __m128 outside = _mm_setzero_ps();
+        for (int p = 0; p < 6; p++)
+        {
+            const __m128 nx = _mm_set1_ps(planes[p].x);
+            const __m128 ny = _mm_set1_ps(planes[p].y);
+            const __m128 nz = _mm_set1_ps(planes[p].z);
 
+            const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(planes[p].w)));
+            const __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex), _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)),
+                _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
 
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+        }
 
-        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(mesh.model));
-        glUniformMatrix4fv(viewLocation, 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(projLocation, 1, GL_FALSE, glm::value_ptr(projection));
+        const int mask = _mm_movemask_ps(outside);
+        for (int k = 0; k < 4; k++)
+            gVisible[i + k] = !(mask & (1 << k));
+    }
+}
+#endif
 
-        glUniform1f(transparencyLoc, mesh.transparency);
+// Surface area of a box, halved; only ever compared with other areas
+float UHalfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    const glm::vec3 size = boundsMax - boundsMin;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
 
+// Builds the hierarchy over bvh.itemMin/itemMax top down. Each node is split
+// where the surface area heuristic says rays and frustums will touch the
+// fewest items, trying BVH_BINS planes along each axis of its centroids.
+void UBuildBvh(Bvh& bvh)
+{
+    const GLuint nItems = bvh.itemMin.size();
+
+    bvh.nodes.clear();
+    bvh.parents.clear();
+    bvh.items.resize(nItems);
+    bvh.leafOf.assign(nItems, 0);
+    for (GLuint i = 0; i < nItems; i++)
+        bvh.items[i] = i;
+
+    if (nItems == 0)
+        return;
+
+    // a binary tree with single item leaves has 2n - 1 nodes
+    bvh.nodes.reserve(2 * nItems);
+    bvh.parents.reserve(2 * nItems);
+    bvh.nodes.push_back({ glm::vec3(0.0f), 0, glm::vec3(0.0f), nItems });
+    bvh.parents.push_back(0);
+
+    // node and its depth; deep enough trees stop splitting so the traversals
+    // can keep their stacks on the stack
+    vector<pair<GLuint, GLuint>> stack = { { 0, 0 } };
+    while (!stack.empty())
+    {
+        const GLuint n = stack.back().first;
+        const GLuint depth = stack.back().second;
+        stack.pop_back();
+
+        UBvhFitNode(bvh, n);
+        const BvhNode node = bvh.nodes[n];
+        if (node.count <= BVH_LEAF_ITEMS || depth + 1 >= BVH_MAX_DEPTH)
+            continue;
+
+        // box of the centres, doubled, which is all the binning needs
+        glm::vec3 centreMin(FLT_MAX), centreMax(-FLT_MAX);
+        for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            const glm::vec3 centre = bvh.itemMin[bvh.items[i]] + bvh.itemMax[bvh.items[i]];
+            centreMin = glm::min(centreMin, centre);
+            centreMax = glm::max(centreMax, centre);
+        }
 
+        // splitting has to beat keeping every item in one leaf
+        float bestCost = node.count * UHalfArea(node.boundsMin, node.boundsMax);
+        int bestAxis = -1;
+        int bestBin = 0;
 
-        glUniform2fv(UVScaleLoc, 1, glm::value_ptr(mesh.gUVScale));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (centreMax[axis] <= centreMin[axis])
+                continue;
+
+            struct Bin
+            {
+                glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+                glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+                GLuint count = 0;
+            } bins[BVH_BINS];
+
+            const float scale = BVH_BINS / (centreMax[axis] - centreMin[axis]);
+            for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+            {
+                const GLuint item = bvh.items[i];
+                const float centre = bvh.itemMin[item][axis] + bvh.itemMax[item][axis];
+                Bin& bin = bins[min(BVH_BINS - 1, int((centre - centreMin[axis]) * scale))];
+                bin.boundsMin = glm::min(bin.boundsMin, bvh.itemMin[item]);
+                bin.boundsMax = glm::max(bin.boundsMax, bvh.itemMax[item]);
+                bin.count++;
+            }
 
-        // Pass color, light, and camera data to the shape shader 
-        glUniform3f(objectColorLoc, mesh.p[0], mesh.p[1], mesh.p[2]);
+            // everything right of each plane, swept from the far end
+            float rightArea[BVH_BINS];
+            GLuint rightCount[BVH_BINS];
+            Bin right;
+            for (int b = BVH_BINS - 1; b > 0; b--)
+            {
+                right.boundsMin = glm::min(right.boundsMin, bins[b].boundsMin);
+                right.boundsMax = glm::max(right.boundsMax, bins[b].boundsMax);
+                right.count += bins[b].count;
+                rightArea[b] = right.count ? UHalfArea(right.boundsMin, right.boundsMax) : 0.0f;
+                rightCount[b] = right.count;
+            }
 
+            // and left of it, pricing each plane on the way
+            Bin left;
+            for (int b = 0; b < BVH_BINS - 1; b++)
+            {
+                left.boundsMin = glm::min(left.boundsMin, bins[b].boundsMin);
+                left.boundsMax = glm::max(left.boundsMax, bins[b].boundsMax);
+                left.count += bins[b].count;
+                if (left.count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const float cost = left.count * UHalfArea(left.boundsMin, left.boundsMax) + rightCount[b + 1] * rightArea[b + 1];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
 
+        if (bestAxis < 0)
+            continue;
+
+        // same binning as above, so the split matches the priced one
+        const float scale = BVH_BINS / (centreMax[bestAxis] - centreMin[bestAxis]);
+        const auto first = bvh.items.begin() + node.leftFirst;
+        const auto middle = partition(first, first + node.count, [&](GLuint item) {
+            const float centre = bvh.itemMin[item][bestAxis] + bvh.itemMax[item][bestAxis];
+            return min(BVH_BINS - 1, int((centre - centreMin[bestAxis]) * scale)) <= bestBin;
+        });
+        const GLuint leftCount = middle - first;
+
+        const GLuint left = bvh.nodes.size();
+        bvh.nodes.push_back({ glm::vec3(0.0f), node.leftFirst, glm::vec3(0.0f), leftCount });
+        bvh.nodes.push_back({ glm::vec3(0.0f), node.leftFirst + leftCount, glm::vec3(0.0f), node.count - leftCount });
+        bvh.parents.push_back(n);
+        bvh.parents.push_back(n);
+
+        bvh.nodes[n].leftFirst = left;
+        bvh.nodes[n].count = 0;
+
+        stack.push_back({ left, depth + 1 });
+        stack.push_back({ left + 1, depth + 1 });
+    }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mesh.textureId);
+    // leaves of several items leave most of the reserved nodes unused
+    bvh.nodes.shrink_to_fit();
+    bvh.parents.shrink_to_fit();
 
+    for (GLuint n = 0; n < bvh.nodes.size(); n++)
+    {
+        const BvhNode& node = bvh.nodes[n];
+        for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+            bvh.leafOf[bvh.items[i]] = n;
+    }
+}
 
+// Box of a node from its items, or from its children for inner nodes
+void UBvhFitNode(Bvh& bvh, GLuint n)
+{
+    BvhNode& node = bvh.nodes[n];
 
-        // Draws the triangles
-        glDrawArrays(GL_TRIANGLES, 0, mesh.nIndices);
+    if (node.count == 0)
+    {
+        const BvhNode& left = bvh.nodes[node.leftFirst];
+        const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+        node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+        node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+        return;
+    }
 
+    node.boundsMin = glm::vec3(FLT_MAX);
+    node.boundsMax = glm::vec3(-FLT_MAX);
+    for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+    {
+        node.boundsMin = glm::min(node.boundsMin, bvh.itemMin[bvh.items[i]]);
+        node.boundsMax = glm::max(node.boundsMax, bvh.itemMax[bvh.items[i]]);
     }
+}
 
-    // Vars for lights
-    glm::mat4 model;
-    GLint modelLoc;
-    GLint viewLoc;
-    GLint projLoc;
+// Refits every node to the current item boxes, keeping the tree's shape.
+// Children always come after their parent, so one backwards pass does it.
+void URefitBvh(Bvh& bvh)
+{
+    for (GLuint n = bvh.nodes.size(); n-- > 0; )
+        UBvhFitNode(bvh, n);
+}
 
-    // --------------------
-    // Draw the Spot Light
-    if (gSpotLightOn) {
-        glUseProgram(gLightProgramId);
-        glBindVertexArray(spotLightMesh.vao);
+// Moves one item's box and refits the nodes above it, stopping as soon as a
+// node's box comes out unchanged. Cheap when only a few items move; the tree
+// gets looser the further they go, so rebuild after big changes.
+void UBvhUpdateItem(Bvh& bvh, GLuint item, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    bvh.itemMin[item] = boundsMin;
+    bvh.itemMax[item] = boundsMax;
 
-        // Light location and Scale
-        model = glm::translate(gSpotLightPosition) * glm::scale(gSpotLightScale);
+    GLuint n = bvh.leafOf[item];
+    while (true)
+    {
+        const BvhNode before = bvh.nodes[n];
+        UBvhFitNode(bvh, n);
+        if (n == 0 || (bvh.nodes[n].boundsMin == before.boundsMin && bvh.nodes[n].boundsMax == before.boundsMax))
+            break;
+        n = bvh.parents[n];
+    }
+}
 
-        // Matrix uniforms from the Light Shader program
-        modelLoc = glGetUniformLocation(gLightProgramId, "model");
-        viewLoc = glGetUniformLocation(gLightProgramId, "view");
-        projLoc = glGetUniformLocation(gLightProgramId, "projection");
+// Frustum test of one box; outsideMask gets the planes the box is entirely
+// behind, insideMask those it is entirely in front of
+bool UBoxInFrustum(const glm::vec4 planes[6], unsigned planeMask, const glm::vec3& boundsMin, const glm::vec3& boundsMax, unsigned& insideMask)
+{
+    const glm::vec3 centre = (boundsMin + boundsMax) * 0.5f;
+    const glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
 
-        // Matrix data
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    insideMask = 0;
+    for (int p = 0; p < 6; p++)
+    {
+        if (!(planeMask & (1 << p)))
+            continue;
 
-        // Draw the light
-        glDrawArrays(GL_TRIANGLES, 0, spotLightMesh.nVertices);
-        // --------------------
+        const glm::vec4& plane = planes[p];
+        const float distance = glm::dot(glm::vec3(plane), centre) + plane.w;
+        const float reach = fabsf(plane.x) * extent.x + fabsf(plane.y) * extent.y + fabsf(plane.z) * extent.z;
+        if (distance + reach < 0.0f)
+            return false;
+        if (distance - reach >= 0.0f)
+            insideMask |= 1 << p;
     }
-    
+    return true;
+}
 
+// Sets visible[item] for every item whose box is inside the frustum. A node
+// in front of a plane passes that plane to its whole subtree, so a node that
+// is entirely inside only costs a walk down to its items.
+void UBvhCullFrustum(const Bvh& bvh, const glm::vec4 planes[6], vector<unsigned char>& visible)
+{
+    fill(visible.begin(), visible.end(), 0);
+    if (bvh.nodes.empty())
+        return;
 
-   
+    // node and the planes still left to test for it
+    pair<GLuint, unsigned> stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = { 0, 0x3F };
 
+    while (top > 0)
+    {
+        const GLuint n = stack[--top].first;
+        unsigned planeMask = stack[top].second;
+        const BvhNode& node = bvh.nodes[n];
 
-    // deactivate vao
-    glBindVertexArray(0);
-    glUseProgram(0);
+        unsigned insideMask;
+        if (planeMask && !UBoxInFrustum(planes, planeMask, node.boundsMin, node.boundsMax, insideMask))
+            continue;
+        if (planeMask)
+            planeMask &= ~insideMask;
 
-    // swap front and back buffers
-    glfwSwapBuffers(gWindow);
+        if (node.count == 0)
+        {
+            assert(top + 2 <= int(BVH_MAX_DEPTH));
+            stack[top++] = { node.leftFirst + 1, planeMask };
+            stack[top++] = { node.leftFirst, planeMask };
+            continue;
+        }
 
+        for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            const GLuint item = bvh.items[i];
+            visible[item] = !planeMask || UBoxInFrustum(planes, planeMask, bvh.itemMin[item], bvh.itemMax[item], insideMask);
+        }
+    }
 }
 
-
-
-void UBuildScene(vector<GLMesh>& scene)
+// Every item whose box overlaps the given one, in no particular order
+void UBvhQueryBox(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, vector<GLuint>& hits)
 {
+    hits.clear();
+    if (bvh.nodes.empty())
+        return;
 
+    auto overlaps = [&](const glm::vec3& otherMin, const glm::vec3& otherMax) {
+        return otherMin.x <= boundsMax.x && otherMin.y <= boundsMax.y && otherMin.z <= boundsMax.z
+            && boundsMin.x <= otherMax.x && boundsMin.y <= otherMax.y && boundsMin.z <= otherMax.z;
+    };
 
+    GLuint stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
 
-    //---------------------------------------- LAVA LAMP -----------------------------------------------------------------------
+    while (top > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--top]];
+        if (!overlaps(node.boundsMin, node.boundsMax))
+            continue;
 
-    // CONE - Top Cap of Lava Lamp
-    GLMesh con_mesh_00;
-    con_mesh_00.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        0.2f, 0.2f, 0.2f,					// scale x, y, z
-        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
+        if (node.count == 0)
+        {
+            assert(top + 2 <= int(BVH_MAX_DEPTH));
+            stack[top++] = node.leftFirst + 1;
+            stack[top++] = node.leftFirst;
+            continue;
+        }
+
+        for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            if (overlaps(bvh.itemMin[bvh.items[i]], bvh.itemMax[bvh.items[i]]))
+                hits.push_back(bvh.items[i]);
+        }
+    }
+}
+
+// Builds, refits and queries hierarchies over 1k, 10k and 100k random boxes
+// and prints the times, each query checked against testing every box.
+void UBenchmarkBvh()
+{
+    const GLuint itemCounts[] = { 1000, 10000, 100000 };
+    constexpr int repeats = 10;
+    mt19937 random(330);
+
+    auto milliseconds = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+
+    for (GLuint nItems : itemCounts)
+    {
+        // boxes up to half a unit across, spread so the density stays the same
+        const float halfSide = 10.0f * cbrtf(nItems / 1000.0f);
+        uniform_real_distribution<float> position(-halfSide, halfSide);
+        uniform_real_distribution<float> size(0.05f, 0.25f);
+
+        Bvh bvh;
+        for (GLuint i = 0; i < nItems; i++)
+        {
+            const glm::vec3 centre(position(random), position(random), position(random));
+            const glm::vec3 extent(size(random), size(random), size(random));
+            bvh.itemMin.push_back(centre - extent);
+            bvh.itemMax.push_back(centre + extent);
+        }
+
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            UBuildBvh(bvh);
+        const double buildTime = milliseconds(start) / repeats;
+
+        // a camera on the edge of the cloud looking into it
+        glm::vec4 planes[6];
+        UFrustumPlanes(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 2.0f * halfSide)
+            * glm::lookAt(glm::vec3(0.0f, 0.0f, halfSide), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)), planes);
+
+        vector<unsigned char> visible(nItems), expected(nItems);
+        start = chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            UBvhCullFrustum(bvh, planes, visible);
+        const double cullTime = milliseconds(start) / repeats;
+
+        unsigned insideMask;
+        start = chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+        {
+            for (GLuint i = 0; i < nItems; i++)
+                expected[i] = UBoxInFrustum(planes, 0x3F, bvh.itemMin[i], bvh.itemMax[i], insideMask);
+        }
+        const double linearCullTime = milliseconds(start) / repeats;
+        const GLuint nVisible = count(visible.begin(), visible.end(), 1);
+        bool matches = visible == expected;
+
+        // boxes two units across around random points
+        constexpr int queries = 1000;
+        vector<glm::vec3> queryCentres;
+        for (int q = 0; q < queries; q++)
+            queryCentres.push_back(glm::vec3(position(random), position(random), position(random)));
+
+        vector<GLuint> hits;
+        GLuint nHits = 0, nExpectedHits = 0;
+        start = chrono::steady_clock::now();
+        for (const glm::vec3& centre : queryCentres)
+        {
+            UBvhQueryBox(bvh, centre - 1.0f, centre + 1.0f, hits);
+            nHits += hits.size();
+        }
+        const double queryTime = milliseconds(start) / queries;
+
+        for (const glm::vec3& centre : queryCentres)
+        {
+            for (GLuint i = 0; i < nItems; i++)
+            {
+                const glm::vec3 low = glm::max(bvh.itemMin[i], centre - 1.0f);
+                const glm::vec3 high = glm::min(bvh.itemMax[i], centre + 1.0f);
+                nExpectedHits += low.x <= high.x && low.y <= high.y && low.z <= high.z;
+            }
+        }
+
+        // one box in a hundred nudged, refitting only above it, then the
+        // whole tree refitted and rebuilt for comparison
+        uniform_int_distribution<GLuint> pick(0, nItems - 1);
+        uniform_real_distribution<float> nudge(-0.5f, 0.5f);
+        const GLuint nMoved = nItems / 100;
+        start = chrono::steady_clock::now();
+        for (GLuint m = 0; m < nMoved; m++)
+        {
+            const GLuint item = pick(random);
+            const glm::vec3 offset(nudge(random), nudge(random), nudge(random));
+            UBvhUpdateItem(bvh, item, bvh.itemMin[item] + offset, bvh.itemMax[item] + offset);
+        }
+        const double updateTime = milliseconds(start);
+
+        UBvhCullFrustum(bvh, planes, visible);
+        for (GLuint i = 0; i < nItems; i++)
+            expected[i] = UBoxInFrustum(planes, 0x3F, bvh.itemMin[i], bvh.itemMax[i], insideMask);
+        matches = matches && visible == expected;
+
+        start = chrono::steady_clock::now();
+        URefitBvh(bvh);
+        const double refitTime = milliseconds(start);
+
+        cout << "BENCH: bvh " << nItems << " boxes, " << bvh.nodes.size() << " nodes: build " << buildTime << " ms"
+            << " | frustum " << cullTime << " ms (" << nVisible << " visible; every box " << linearCullTime << " ms)"
+            << " | box query " << queryTime * 1000.0 << " us (" << float(nHits) / queries << " hits)"
+            << " | update " << nMoved << " boxes " << updateTime << " ms, full refit " << refitTime << " ms"
+            << (matches && nHits == nExpectedHits ? "" : " (RESULTS DIFFER FROM TESTING EVERY BOX)") << endl;
+    }
+}
+
+// Keeps the positions and triangles of an uploaded shape with a hierarchy
+// over the triangles, for picking. Every mesh drawing the shape shares it.
+void UBuildPickGeometry(const GLMesh& mesh)
+{
+    PickGeometry& pick = gPickGeometry[UGeometryKey(mesh)];
+    if (!pick.indices.empty())
+        return;
+
+    const GLuint nVertices = mesh.v.size() / FLOATS_PER_VERTEX;
+    pick.positions.resize(nVertices);
+    for (GLuint i = 0; i < nVertices; i++)
+        pick.positions[i] = glm::vec3(mesh.v[i * FLOATS_PER_VERTEX], mesh.v[i * FLOATS_PER_VERTEX + 1], mesh.v[i * FLOATS_PER_VERTEX + 2]);
+    pick.indices = mesh.indices;
+
+    const GLuint nTriangles = pick.indices.size() / 3;
+    pick.bvh.itemMin.resize(nTriangles);
+    pick.bvh.itemMax.resize(nTriangles);
+    for (GLuint t = 0; t < nTriangles; t++)
+    {
+        const glm::vec3& a = pick.positions[pick.indices[t * 3]];
+        const glm::vec3& b = pick.positions[pick.indices[t * 3 + 1]];
+        const glm::vec3& c = pick.positions[pick.indices[t * 3 + 2]];
+        pick.bvh.itemMin[t] = glm::min(a, glm::min(b, c));
+        pick.bvh.itemMax[t] = glm::max(a, glm::max(b, c));
+    }
+    UBuildBvh(pick.bvh);
+}
+
+// Ray from the eye through a point of the window, in world space. The point
+// is in window coordinates, y down, as GLFW reports the cursor.
+void UCursorRay(double x, double y, int width, int height, const glm::mat4& viewProjection, glm::vec3& origin, glm::vec3& direction)
+{
+    const float ndcX = float(2.0 * x / width - 1.0);
+    const float ndcY = float(1.0 - 2.0 * y / height);
+
+    // back from the near and the far plane
+    const glm::mat4 inverse = glm::inverse(viewProjection);
+    const glm::vec4 nearPoint = inverse * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+    const glm::vec4 farPoint = inverse * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+
+    origin = glm::vec3(nearPoint) / nearPoint.w;
+    direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+}
+
+// Distance along the ray to where it enters the box, if it does before
+// maxDistance (slab test)
+bool URayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float maxDistance, float& entry)
+{
+    float tNear = 0.0f;
+    float tFar = maxDistance;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (boundsMin[axis] - origin[axis]) * inverseDirection[axis];
+        float t1 = (boundsMax[axis] - origin[axis]) * inverseDirection[axis];
+        if (t0 > t1)
+            swap(t0, t1);
+
+        // NaN from a zero direction inside the slab leaves the range alone
+        tNear = t0 > tNear ? t0 : tNear;
+        tFar = t1 < tFar ? t1 : tFar;
+        if (tNear > tFar)
+            return false;
+    }
+
+    entry = tNear;
+    return true;
+}
+
+// Distance along the ray to the triangle, either side facing
+// (Moller & Trumbore)
+bool URayTriangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& distance)
+{
+    const glm::vec3 edge1 = b - a;
+    const glm::vec3 edge2 = c - a;
+    const glm::vec3 p = glm::cross(direction, edge2);
+    const float determinant = glm::dot(edge1, p);
+    if (fabsf(determinant) < 1e-12f)
+        return false;
+
+    const float inverseDeterminant = 1.0f / determinant;
+    const glm::vec3 s = origin - a;
+    const float u = glm::dot(s, p) * inverseDeterminant;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    const glm::vec3 q = glm::cross(s, edge1);
+    const float v = glm::dot(direction, q) * inverseDeterminant;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    distance = glm::dot(edge2, q) * inverseDeterminant;
+    return distance >= 0.0f;
+}
+
+// Nearest triangle of the shape the ray hits closer than nearest, walking
+// the triangle hierarchy nearest child first. Returns the new nearest.
+float URayPickGeometry(const PickGeometry& pick, const glm::vec3& origin, const glm::vec3& direction, float nearest)
+{
+    const Bvh& bvh = pick.bvh;
+    if (bvh.nodes.empty())
+        return nearest;
+
+    const glm::vec3 inverseDirection = 1.0f / direction;
+
+    GLuint stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--top]];
+        float entry;
+        if (!URayBox(origin, inverseDirection, node.boundsMin, node.boundsMax, nearest, entry))
+            continue;
+
+        if (node.count == 0)
+        {
+            float leftEntry, rightEntry;
+            const BvhNode& left = bvh.nodes[node.leftFirst];
+            const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+            const bool hitLeft = URayBox(origin, inverseDirection, left.boundsMin, left.boundsMax, nearest, leftEntry);
+            const bool hitRight = URayBox(origin, inverseDirection, right.boundsMin, right.boundsMax, nearest, rightEntry);
+
+            // the nearer child goes on top so its hits can prune the other
+            assert(top + 2 <= int(BVH_MAX_DEPTH));
+            if (hitLeft && hitRight)
+            {
+                const bool leftFirst = leftEntry <= rightEntry;
+                stack[top++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+                stack[top++] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+            }
+            else if (hitLeft)
+                stack[top++] = node.leftFirst;
+            else if (hitRight)
+                stack[top++] = node.leftFirst + 1;
+            continue;
+        }
+
+        for (GLuint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            const GLuint t = bvh.items[i];
+            float distance;
+            if (URayTriangle(origin, direction, pick.positions[pick.indices[t * 3]], pick.positions[pick.indices[t * 3 + 1]],
+                pick.positions[pick.indices[t * 3 + 2]], distance) && distance < nearest)
+                nearest = distance;
+        }
+    }
+
+    return nearest;
+}
+
+// Nearest mesh of the world the ray hits, and where. Meshes whose bounds the
+// ray misses, or enters beyond the best hit so far, are skipped; the rest
+// are tested in their own space, where the model matrix keeps distances
+// along the ray unchanged. Levels of detail are never hit: picking uses the
+// full detail shape.
+bool UPickRay(const vector<GLMesh>& world, const glm::vec3& origin, const glm::vec3& direction, PickHit& hit)
+{
+    float nearest = FLT_MAX;
+    hit.mesh = -1;
+
+    for (GLuint i = 0; i < world.size(); i++)
+    {
+        const GLMesh& mesh = world[i];
+        if (mesh.lodOf >= 0)
+            continue;
+        const auto pick = gPickGeometry.find(UGeometryKey(mesh));
+        if (pick == gPickGeometry.end())
+            continue;
+
+        const glm::mat4 toLocal = glm::inverse(mesh.model);
+        const glm::vec3 localOrigin = glm::vec3(toLocal * glm::vec4(origin, 1.0f));
+        const glm::vec3 localDirection = glm::vec3(toLocal * glm::vec4(direction, 0.0f));
+
+        float entry;
+        if (!URayBox(localOrigin, 1.0f / localDirection, mesh.boundsMin, mesh.boundsMax, nearest, entry))
+            continue;
+
+        const float distance = URayPickGeometry(pick->second, localOrigin, localDirection, nearest);
+        if (distance < nearest)
+        {
+            nearest = distance;
+            hit.mesh = i;
+        }
+    }
+
+    if (hit.mesh < 0)
+        return false;
+
+    hit.distance = nearest;
+    hit.point = origin + direction * nearest;
+    return true;
+}
+
+// Picks what is under the cursor, or under the middle of the window while
+// the cursor drives the camera, and reports it
+void UPickAtCursor(GLFWwindow* window)
+{
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+
+    double x = width * 0.5;
+    double y = height * 0.5;
+    if (glfwGetInputMode(window, GLFW_CURSOR) != GLFW_CURSOR_DISABLED)
+        glfwGetCursorPos(window, &x, &y);
+
+    const auto start = chrono::steady_clock::now();
+
+    glm::vec3 origin, direction;
+    UCursorRay(x, y, width, height, UProjectionMatrix() * gCamera.GetViewMatrix(), origin, direction);
+
+    PickHit hit;
+    const bool found = UPickRay(scene, origin, direction, hit);
+    const double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    if (!found)
+    {
+        cout << "PICK: nothing (" << milliseconds << " ms)" << endl;
+        return;
+    }
+
+    const GLMesh& mesh = scene[hit.mesh];
+    cout << "PICK: mesh " << hit.mesh << " (" << gPrimitiveNames[mesh.primitive] << ", " << mesh.texFilename << ") at "
+        << hit.point.x << ", " << hit.point.y << ", " << hit.point.z << " (" << milliseconds << " ms)" << endl;
+}
+
+// Picks each round mesh's level of detail from the size of its bounding
+// sphere on screen. A circle of r pixels drawn with n sides strays about
+// r * (pi / n)^2 / 2 pixels from the true outline, so n = pi * sqrt(r / 2e)
+// keeps that under e = LOD_PIXEL_ERROR. Finer levels are taken at once;
+// coarser ones only with LOD_HYSTERESIS to spare.
+void USelectLods(vector<GLDrawItem>& drawList, const glm::mat4& view, const glm::mat4& projection, int viewportHeight)
+{
+    // pixels per unit of view space at clip w = 1, for either projection
+    const float pixelScale = projection[1][1] * viewportHeight * 0.5f;
+
+    for (GLuint i = 0; i < drawList.size(); i++)
+    {
+        GLDrawItem& item = drawList[i];
+        if (item.lodCount == 0 || !gVisible[i])
+            continue;
+
+        const LodLevel* levels = &gLodLevels[item.lodFirst];
+        const GLuint finest = item.lodCount - 1;
+
+        GLuint finer = finest;
+        GLuint coarser = finest;
+
+        // clip w is the distance in front of the camera in perspective and 1 in ortho
+        const glm::vec4 viewCentre = view * glm::vec4(item.boundsCentre, 1.0f);
+        const float w = projection[2][3] * viewCentre.z + projection[3][3];
+
+        // with the camera inside the sphere the mesh may fill the screen
+        if (w > item.boundsRadius)
+        {
+            const float pixelRadius = item.boundsRadius * pixelScale / w;
+            const float needed = glm::pi<float>() * sqrtf(pixelRadius / (2.0f * LOD_PIXEL_ERROR));
+
+            finer = 0;
+            while (finer < finest && levels[finer].sides < needed)
+                ++finer;
+
+            coarser = finer;
+            while (coarser < finest && levels[coarser].sides < needed * (1.0f + LOD_HYSTERESIS))
+                ++coarser;
+        }
+
+        if (finer > item.lod)
+            item.lod = finer;
+        else if (coarser < item.lod)
+            item.lod = coarser;
+
+        const LodLevel& level = levels[item.lod];
+        item.vao = level.vao;
+        item.geometryId = level.geometryId;
+        item.baseVertex = level.baseVertex;
+        item.firstIndex = level.firstIndex;
+        item.nIndices = level.nIndices;
+        item.indexType = level.indexType;
+    }
+}
+
+// CPU memory held by one authoring record, including its heap arrays
+size_t UMeshResidentBytes(const GLMesh& mesh)
+{
+    return sizeof(GLMesh) + (mesh.v.capacity() + mesh.p.capacity()) * sizeof(float)
+        + mesh.indices.capacity() * sizeof(GLuint);
+}
+
+// CPU memory held by the pick copy of a shape: positions, triangles and the
+// triangle hierarchy
+size_t UPickResidentBytes(const PickGeometry& pick)
+{
+    return pick.positions.capacity() * sizeof(glm::vec3) + pick.indices.capacity() * sizeof(GLuint)
+        + (pick.bvh.itemMin.capacity() + pick.bvh.itemMax.capacity()) * sizeof(glm::vec3)
+        + pick.bvh.nodes.capacity() * sizeof(BvhNode)
+        + (pick.bvh.items.capacity() + pick.bvh.parents.capacity() + pick.bvh.leafOf.capacity()) * sizeof(GLuint);
+}
+
+// Prints how much CPU memory the scene keeps resident once it is built. The
+// vertex arrays are gone by then; what stays is the authoring records, the
+// draw list and the shapes' pick copies, and the total counts all three.
+void UReportSceneMemory(const vector<GLMesh>& world, const vector<GLDrawItem>& drawList)
+{
+    size_t meshBytes = 0;
+    size_t largestMesh = 0;
+    for (const GLMesh& mesh : world)
+    {
+        const size_t bytes = UMeshResidentBytes(mesh);
+        meshBytes += bytes;
+        largestMesh = max(largestMesh, bytes);
+    }
+
+    const size_t drawBytes = drawList.capacity() * sizeof(GLDrawItem);
+
+    size_t pickBytes = 0;
+    size_t pickTriangles = 0;
+    for (const auto& entry : gPickGeometry)
+    {
+        pickBytes += UPickResidentBytes(entry.second);
+        pickTriangles += entry.second.indices.size() / 3;
+    }
+
+    const size_t totalBytes = meshBytes + drawBytes + pickBytes;
+
+    cout << "INFO: Scene CPU memory: " << world.size() << " meshes, "
+        << meshBytes << " bytes authoring (" << (world.empty() ? 0 : meshBytes / world.size())
+        << " per mesh, largest " << largestMesh << "), "
+        << drawBytes << " bytes draw list (" << sizeof(GLDrawItem) << " per mesh), "
+        << pickBytes << " bytes picking | " << totalBytes << " bytes in all ("
+        << (world.empty() ? 0 : totalBytes / world.size()) << " per mesh)" << endl;
+
+    cout << "INFO: Geometry cache: " << gGeometryCache.size() << " shared shapes for "
+        << world.size() << " meshes" << endl;
+
+    cout << "INFO: Picking: " << gPickGeometry.size() << " shapes, " << pickTriangles << " triangles" << endl;
+
+    // GPU side: exact bytes of the arena in use, plus any shape too big for it
+    const GLuint usedVertices = UArenaUsed(gArena.freeVertices, gArena.vertexCapacity);
+    const GLuint usedIndices = UArenaUsed(gArena.freeIndices, gArena.indexCapacity);
+    const size_t vertexBytes = gVertexFormat->stride;
+
+    size_t ownBytes = 0;
+    set<GLuint> counted;
+    for (const GLMesh& mesh : world)
+    {
+        if (mesh.vao != gArena.vao && counted.insert(mesh.geometryId).second)
+            ownBytes += mesh.nVertices * vertexBytes + mesh.nIndices * sizeof(GLuint);
+    }
+
+    cout << "INFO: Geometry arena (" << gVertexFormat->name << " vertices, " << vertexBytes << " bytes each): " << usedVertices << "/" << gArena.vertexCapacity << " vertices ("
+        << usedVertices * vertexBytes << "/" << gArena.vertexCapacity * vertexBytes << " bytes), "
+        << usedIndices << "/" << gArena.indexCapacity << " indices ("
+        << usedIndices * sizeof(GLushort) << "/" << gArena.indexCapacity * sizeof(GLushort) << " bytes), "
+        << counted.size() << " shapes in own buffers (" << ownBytes << " bytes)" << endl;
+}
+
+// Projection of the camera, perspective or orthographic as toggled with P
+glm::mat4 UProjectionMatrix()
+{
+    if (isPerspective)
+    {
+        // p for perspective (default)
+        return glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, FAR_PLANE);
+    }
+    else
+        // o for ortho
+        return glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, FAR_PLANE);
+}
+
+void URenderScene(vector<GLDrawItem>& drawList)
+{
+
+    // Borrowed from the Tutorial; animates the Spot Light to circle around the scene
+    constexpr float angularVelocity = glm::radians(45.0f);
+    if (gSpotLightOrbit)
+    {
+        PROFILE_SCOPE("light orbit");
+        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gSpotLightPosition, 1.0f);
+        gSpotLightPosition.x = newPosition.x;
+        gSpotLightPosition.y = newPosition.y;
+        gSpotLightPosition.z = newPosition.z;
+    }
+
+
+    // Enable z-depth
+    glEnable(GL_DEPTH_TEST);
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+
+    // transform the camera (x, y, z)
+    glm::mat4 view = gCamera.GetViewMatrix();
+
+
+    //Create a projection depending on whether we are set to perspective or orthographic
+    glm::mat4 projection = UProjectionMatrix();
+
+    // Camera and lights are uploaded once here and shared by every draw below
+    UUpdateFrameUniformBuffer(view, projection);
+
+
+
+
+    // Skip whatever is outside the view, then give the round meshes left the
+    // tessellation their size on screen needs
+    {
+        PROFILE_SCOPE("culling");
+        UCullDrawList(projection * view);
+        USelectLods(drawList, view, projection, gViewportHeight);
+    }
+
+    // Sort the meshes so state changes are minimized and transparent shapes blend back to front
+    {
+        PROFILE_SCOPE("render queue");
+        UBuildRenderQueue(drawList, view);
+
+        // Per-mesh data goes up in queue order, so each batch is one contiguous range
+        UFillInstances(drawList);
+        if (gRenderPath == indirectPath)
+            UBuildIndirectCommands(drawList);
+        UUploadInstances();
+    }
+
+    {
+        PROFILE_SCOPE("draw submission");
+        PROFILE_GPU_SCOPE("scene");
+        if (gRenderPath == indirectPath)
+            URenderIndirect();
+        else
+            URenderPerMesh(drawList);
+    }
+
+    // Vars for lights
+    glm::mat4 model;
+
+    // --------------------
+    // Draw the Spot Light
+    if (gSpotLightOn) {
+        PROFILE_SCOPE("lamp");
+        PROFILE_GPU_SCOPE("lamp");
+        glUseProgram(gLightProgram.id);
+        glBindVertexArray(spotLightMesh.vao);
+        ++gFrameStats.programSwitches;
+        ++gFrameStats.vaoSwitches;
+
+        // Light location and Scale
+        model = glm::translate(gSpotLightPosition) * glm::scale(gSpotLightScale);
+
+        // Matrix data; view and projection come from the frame uniform buffer
+        USetUniform(gLightProgram.modelLoc, model);
+
+        // Draw the light
+        glDrawArrays(GL_TRIANGLES, 0, spotLightMesh.nVertices);
+        ++gFrameStats.drawCalls;
+        gFrameStats.triangles += spotLightMesh.nVertices / 3;
+        // --------------------
+    }
+    
+
+
+   
+
+
+    // deactivate vao
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    // swap front and back buffers
+    PROFILE_SCOPE("swap");
+    glfwSwapBuffers(gWindow);
+
+}
+
+
+// Index one past the batch starting at queue entry first. Neighbouring meshes
+// with the same geometry and program form a batch drawn as one instanced
+// draw, whatever their textures; only identical neighbours are merged, so
+// transparent shapes keep their back to front order.
+GLuint UBatchEnd(const vector<GLDrawItem>& drawList, GLuint first)
+{
+    const GLDrawItem& item = drawList[gRenderQueue[first].itemIndex];
+    const Material material = UEffectiveMaterial(item);
+
+    GLuint last = first + 1;
+    while (last < gRenderQueue.size())
+    {
+        const GLDrawItem& next = drawList[gRenderQueue[last].itemIndex];
+        if (next.geometryId != item.geometryId || UEffectiveMaterial(next) != material)
+            break;
+        ++last;
+    }
+
+    return last;
+}
+
+// Draws the queue one instanced call per batch, skipping redundant binds
+void URenderPerMesh(const vector<GLDrawItem>& drawList)
+{
+    // Last state bound, so redundant binds can be skipped
+    GLuint boundProgram = 0;
+    GLuint boundVao = 0;
+
+    // one texture for the whole pass; instances pick their layer
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gSceneTextures);
+    ++gFrameStats.textureSwitches;
+
+    for (GLuint first = 0; first < gRenderQueue.size(); )
+    {
+        const GLDrawItem& item = drawList[gRenderQueue[first].itemIndex];
+        const GLuint last = UBatchEnd(drawList, first);
+
+        gUseProgram = gMaterialPrograms[UEffectiveMaterial(item)];
+
+        // set the shader
+        if (gUseProgram->id != boundProgram)
+        {
+            glUseProgram(gUseProgram->id);
+            boundProgram = gUseProgram->id;
+            ++gFrameStats.programSwitches;
+        }
+
+        // activate vbo's within mesh's vao
+        if (item.vao != boundVao)
+        {
+            glBindVertexArray(item.vao);
+            boundVao = item.vao;
+            ++gFrameStats.vaoSwitches;
+        }
+
+        // Draws the triangles of every instance in the batch from the mesh's
+        // range of the buffers; baseInstance points the per-instance attributes
+        // at the batch's range of the instance buffer
+        const size_t indexSize = item.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, item.nIndices, item.indexType,
+            (void*)(item.firstIndex * indexSize), last - first, item.baseVertex, first);
+        ++gFrameStats.drawCalls;
+        gFrameStats.instances += last - first;
+        gFrameStats.triangles += item.nIndices / 3 * (last - first);
+
+        first = last;
+    }
+}
+
+// Turns the batches of the queue into indirect commands, grouped into as few
+// multi-draw calls as the programs and vaos allow. Uploads the commands.
+void UBuildIndirectCommands(const vector<GLDrawItem>& drawList)
+{
+    // capacity was reserved by UBuildDrawList, so this never reallocates
+    gIndirectCommands.clear();
+    gIndirectGroups.clear();
+
+    for (GLuint first = 0; first < gRenderQueue.size(); )
+    {
+        const GLDrawItem& item = drawList[gRenderQueue[first].itemIndex];
+        const GLuint last = UBatchEnd(drawList, first);
+        const GLuint program = gMaterialPrograms[UEffectiveMaterial(item)]->id;
+
+        IndirectGroup* group = gIndirectGroups.empty() ? nullptr : &gIndirectGroups.back();
+        const bool fits = group && group->program == program && group->vao == item.vao
+            && group->indexType == item.indexType;
+
+        if (!fits)
+        {
+            IndirectGroup next = {};
+            next.program = program;
+            next.vao = item.vao;
+            next.indexType = item.indexType;
+            next.firstCommand = gIndirectCommands.size();
+            gIndirectGroups.push_back(next);
+            group = &gIndirectGroups.back();
+        }
+
+        gIndirectCommands.push_back({ item.nIndices, last - first, item.firstIndex, item.baseVertex, first });
+        group->nCommands++;
+        group->nInstances += last - first;
+        group->nTriangles += item.nIndices / 3 * (last - first);
+
+        first = last;
+    }
+
+    // orphan last frame's commands like the instance buffer
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, gIndirectCommands.capacity() * sizeof(DrawElementsCommand), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, gIndirectCommands.size() * sizeof(DrawElementsCommand), gIndirectCommands.data());
+
+    ++gFrameStats.bufferUploads;
+}
+
+// Draws the queue with one glMultiDrawElementsIndirect call per group. Each
+// command is one batch; its baseInstance picks the batch's per-instance data.
+void URenderIndirect()
+{
+    GLuint boundProgram = 0;
+    GLuint boundVao = 0;
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gSceneTextures);
+    ++gFrameStats.textureSwitches;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+
+    for (const IndirectGroup& group : gIndirectGroups)
+    {
+        if (group.program != boundProgram)
+        {
+            glUseProgram(group.program);
+            boundProgram = group.program;
+            ++gFrameStats.programSwitches;
+        }
+
+        if (group.vao != boundVao)
+        {
+            glBindVertexArray(group.vao);
+            boundVao = group.vao;
+            ++gFrameStats.vaoSwitches;
+        }
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, group.indexType,
+            (void*)(group.firstCommand * sizeof(DrawElementsCommand)), group.nCommands, 0);
+        ++gFrameStats.drawCalls;
+        gFrameStats.instances += group.nInstances;
+        gFrameStats.triangles += group.nTriangles;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+// Material actually used to draw the mesh; glowing shapes fall back to
+// gloss while their light source is switched off
+Material UEffectiveMaterial(const GLDrawItem& item)
+{
+    if (item.material == glow && !lightSources[item.lightSourceId])
+        return gloss;
+
+    return item.material;
+}
+
+// Packs the draw state of an item into a 64-bit key (layout documented on RenderQueueEntry).
+// depth is the view-space distance of the item's origin in front of the camera.
+uint64_t UMakeSortKey(const GLDrawItem& item, Material material, float depth)
+{
+    // quantize depth to 24 bits over [0, FAR_PLANE]
+    const float normalized = glm::clamp(depth / FAR_PLANE, 0.0f, 1.0f);
+    const uint64_t depthBits = (uint64_t)(normalized * 16777215.0f) & 0xFFFFFF;
+
+    const uint64_t programBits = (uint64_t)material & 0x7;
+    const uint64_t geometryBits = (uint64_t)item.geometryId & 0xFFFF;
+
+    if (item.transparency < 1.0f)
+    {
+        // farthest first, so invert the depth
+        return (1ull << 63) | ((0xFFFFFF - depthBits) << 39) | (programBits << 36) | (geometryBits << 20);
+    }
+
+    return (programBits << 60) | (geometryBits << 44) | (depthBits << 20);
+}
+
+// Fills gRenderQueue with one sorted entry per visible draw item. The queue
+// was reserved by UBuildDrawList, so this never reallocates.
+void UBuildRenderQueue(const vector<GLDrawItem>& drawList, const glm::mat4& view)
+{
+    gRenderQueue.clear();
+
+    for (GLuint i = 0; i < drawList.size(); ++i)
+    {
+        // outside the frustum
+        if (!gVisible[i])
+        {
+            ++gFrameStats.culled;
+            continue;
+        }
+
+        const GLDrawItem& item = drawList[i];
+
+        // the camera looks down -z in view space
+        const glm::vec4 viewPosition = view * item.model[3];
+
+        gRenderQueue.push_back({ UMakeSortKey(item, UEffectiveMaterial(item), -viewPosition.z), i });
+    }
+
+    gFrameStats.visible += gRenderQueue.size();
+
+    URadixSortRenderQueue(gRenderQueue, gRenderQueueScratch);
+}
+
+// Stable LSD radix sort on the 64-bit keys, one byte per pass.
+// Passes where every key has the same byte are skipped, which is most of
+// them since only a few bits of each field are ever set.
+void URadixSortRenderQueue(vector<RenderQueueEntry>& queue, vector<RenderQueueEntry>& scratch)
+{
+    constexpr int passes = 8;
+    constexpr int buckets = 256;
+
+    const size_t count = queue.size();
+    scratch.resize(count);
+
+    // histogram every byte in a single read over the keys
+    size_t histogram[passes][buckets] = {};
+    for (const RenderQueueEntry& entry : queue)
+    {
+        for (int pass = 0; pass < passes; ++pass)
+            ++histogram[pass][(entry.key >> (pass * 8)) & 0xFF];
+    }
+
+    vector<RenderQueueEntry>* from = &queue;
+    vector<RenderQueueEntry>* to = &scratch;
+
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        const int shift = pass * 8;
+
+        // nothing to do if all keys land in one bucket
+        if (count == 0 || histogram[pass][((*from)[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        // exclusive prefix sum gives each bucket's start offset
+        size_t offset = 0;
+        for (int b = 0; b < buckets; ++b)
+        {
+            const size_t n = histogram[pass][b];
+            histogram[pass][b] = offset;
+            offset += n;
+        }
+
+        for (const RenderQueueEntry& entry : *from)
+            (*to)[histogram[pass][(entry.key >> shift) & 0xFF]++] = entry;
+
+        std::swap(from, to);
+    }
+
+    // an odd number of passes leaves the result in the scratch buffer
+    if (from != &queue)
+        queue.swap(scratch);
+}
+
+
+// Scene files
+// -----------
+// A scene is a text file for authoring, or the binary form --compile-scene
+// makes from one. In the text form each object starts with its primitive on
+// a line of its own (cube, plane, circle, cylinder, hollow-cylinder or cone),
+// followed by one property per line. # starts a comment.
+//
+//     cone
+//     texture textures/lava.png
+//     material glow           matte (the default), satin, gloss or glow
+//     scale 1 1 1
+//     rotate 0 0 0            degrees about x, y and z
+//     translate 0 0 2
+//     uv-scale 1 1
+//     height 1.8              and length, radius, inner-radius, sides
+//     transparency 0.7        from 0 (clear) to 1 (opaque, the default)
+//
+// Round primitives need a whole number of sides, 3 or more, and a positive
+// radius; all but circles a positive height too. Shapes ignore what they
+// don't use. color is no longer drawn; it is skipped with a warning.
+//
+// Both forms are read straight into the scene's meshes, a line or a batch of
+// records at a time. Glow objects light the scene: each one gets a light
+// source, and O toggles the first.
+
+// Next whitespace separated word of a line, or an empty one at its end
+const char* USceneWord(const char*& cursor, size_t& length)
+{
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+        cursor++;
+
+    const char* word = cursor;
+    while (*cursor && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+        cursor++;
+
+    length = cursor - word;
+    return word;
+}
+
+bool USceneWordIs(const char* word, size_t length, const char* keyword)
+{
+    return strncmp(word, keyword, length) == 0 && keyword[length] == '\0';
+}
+
+// Reads count numbers, and nothing after them, from the rest of a line
+bool USceneNumbers(const char* cursor, float* values, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        char* end;
+        values[i] = strtof(cursor, &end);
+        if (end == cursor)
+            return false;
+        cursor = end;
+    }
+
+    size_t length;
+    USceneWord(cursor, length);
+    return length == 0;
+}
+
+// Index of the word in a keyword table, or -1
+int USceneKeyword(const char* word, size_t length, const char* const* keywords, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (USceneWordIs(word, length, keywords[i]))
+            return i;
+    }
+    return -1;
+}
+
+// Scene files point their meshes at one shared copy of each texture path
+const char* USceneString(const char* text, size_t length)
+{
+    return gSceneStrings.insert(string(text, length)).first->c_str();
+}
+
+// Starts a mesh of the scene with an identity transform
+GLMesh& UAddSceneMesh(vector<GLMesh>& scene, Primitive primitive)
+{
+    scene.emplace_back();
+    GLMesh& mesh = scene.back();
+    mesh.primitive = primitive;
+    mesh.texFilename = nullptr;
+    mesh.p = {
+        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
+        1.0f, 1.0f, 1.0f,					// scale x, y, z
+        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
         0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
         0.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.4f, 1.47f, 2.4f,					// translate x, y, z
-        1.0f, 1.0f
+        0.0f, 0.0f, 0.0f,					// translate x, y, z
+        1.0f, 1.0f							// uv scale
+    };
+    return mesh;
+}
+
+bool USceneSidesValid(float sides)
+{
+    return sides >= 3.0f && sides <= MAX_SCENE_SIDES && sides == floorf(sides);
+}
+
+// Which shape values a primitive is built from: round ones have sides and a
+// radius, and all of those but the circle a height
+bool USceneUsesRadius(Primitive primitive)
+{
+    return primitive != cube && primitive != plane;
+}
+
+bool USceneUsesHeight(Primitive primitive)
+{
+    return USceneUsesRadius(primitive) && primitive != circle;
+}
+
+bool USceneTransparencyValid(float transparency)
+{
+    return transparency >= 0.0f && transparency <= 1.0f;
+}
+
+// Why the generators can't build the mesh, or nullptr
+const char* USceneShapeError(const GLMesh& mesh)
+{
+    if (!USceneTransparencyValid(mesh.transparency))
+        return "transparency must be from 0 to 1";
+    if (!USceneUsesRadius(mesh.primitive))
+        return nullptr;
+    if (!USceneSidesValid(mesh.number_of_sides))
+        return "sides must be a whole number from 3 to 65536";
+    if (!(mesh.radius > 0.0f))
+        return "radius must be positive";
+    if (USceneUsesHeight(mesh.primitive) && !(mesh.height > 0.0f))
+        return "height must be positive";
+    return nullptr;
+}
+
+// Gives a glow mesh its light source
+void UFinishSceneMesh(GLMesh& mesh)
+{
+    if (mesh.material == glow)
+    {
+        lightSources.push_back(true);
+        mesh.lightSourceId = lightSources.size() - 1;
+    }
+}
+
+bool ULoadSceneText(istream& file, const char* path, vector<GLMesh>& scene)
+{
+    string line;
+    GLuint lineNumber = 0;
+    GLuint objectLine = 0;
+    GLMesh* mesh = nullptr;
+
+    auto fail = [&](const char* message) {
+        cout << "Failed to load scene " << path << ", line " << lineNumber << ": " << message << endl;
+        return false;
+    };
+
+    // an object ends where the next one starts, or at the end of the file;
+    // what it lacks is reported at the line it started on
+    auto finish = [&]() {
+        if (!mesh)
+            return true;
+        const char* error = mesh->texFilename ? USceneShapeError(*mesh) : "the object has no texture";
+        if (error)
+        {
+            lineNumber = objectLine;
+            return fail(error);
+        }
+        UFinishSceneMesh(*mesh);
+        return true;
+    };
+
+    while (getline(file, line))
+    {
+        lineNumber++;
+        const size_t comment = line.find('#');
+        if (comment != string::npos)
+            line.resize(comment);
+
+        const char* cursor = line.c_str();
+        size_t length;
+        const char* word = USceneWord(cursor, length);
+        if (length == 0)
+            continue;
+
+        const int primitive = USceneKeyword(word, length, gScenePrimitiveKeywords, 6);
+        if (primitive >= 0)
+        {
+            if (!finish())
+                return false;
+            mesh = &UAddSceneMesh(scene, Primitive(primitive));
+            objectLine = lineNumber;
+            continue;
+        }
+
+        if (!mesh)
+            return fail("expected a primitive to start an object");
+
+        float* p = mesh->p.data();
+        bool valid;
+        if (USceneWordIs(word, length, "texture"))
+        {
+            // the rest of the line, so paths may hold spaces
+            while (*cursor == ' ' || *cursor == '\t')
+                cursor++;
+            size_t end = strlen(cursor);
+            while (end > 0 && (cursor[end - 1] == ' ' || cursor[end - 1] == '\t' || cursor[end - 1] == '\r'))
+                end--;
+            valid = end > 0;
+            mesh->texFilename = USceneString(cursor, end);
+        }
+        else if (USceneWordIs(word, length, "material"))
+        {
+            word = USceneWord(cursor, length);
+            const int material = USceneKeyword(word, length, gSceneMaterialKeywords, 4);
+            valid = material >= 0;
+            mesh->material = Material(max(material, 0));
+        }
+        else if (USceneWordIs(word, length, "color"))
+        {
+            // objects take their colour from the texture only
+            cout << "WARNING: scene " << path << ", line " << lineNumber << ": color is obsolete and ignored" << endl;
+            continue;
+        }
+        else if (USceneWordIs(word, length, "scale"))
+            valid = USceneNumbers(cursor, p + 4, 3);
+        else if (USceneWordIs(word, length, "rotate"))
+        {
+            float angles[3];
+            valid = USceneNumbers(cursor, angles, 3);
+            p[7] = angles[0];
+            p[11] = angles[1];
+            p[15] = angles[2];
+        }
+        else if (USceneWordIs(word, length, "translate"))
+            valid = USceneNumbers(cursor, p + 19, 3);
+        else if (USceneWordIs(word, length, "uv-scale"))
+            valid = USceneNumbers(cursor, p + 22, 2);
+        else if (USceneWordIs(word, length, "height"))
+        {
+            valid = USceneNumbers(cursor, &mesh->height, 1);
+            if (valid && USceneUsesHeight(mesh->primitive) && !(mesh->height > 0.0f))
+                return fail("height must be positive");
+        }
+        else if (USceneWordIs(word, length, "length"))
+            valid = USceneNumbers(cursor, &mesh->length, 1);
+        else if (USceneWordIs(word, length, "radius"))
+        {
+            valid = USceneNumbers(cursor, &mesh->radius, 1);
+            if (valid && USceneUsesRadius(mesh->primitive) && !(mesh->radius > 0.0f))
+                return fail("radius must be positive");
+        }
+        else if (USceneWordIs(word, length, "inner-radius"))
+            valid = USceneNumbers(cursor, &mesh->innerRadius, 1);
+        else if (USceneWordIs(word, length, "sides"))
+        {
+            valid = USceneNumbers(cursor, &mesh->number_of_sides, 1);
+            if (valid && USceneUsesRadius(mesh->primitive) && !USceneSidesValid(mesh->number_of_sides))
+                return fail("sides must be a whole number from 3 to 65536");
+        }
+        else if (USceneWordIs(word, length, "transparency"))
+        {
+            valid = USceneNumbers(cursor, &mesh->transparency, 1);
+            if (valid && !USceneTransparencyValid(mesh->transparency))
+                return fail("transparency must be from 0 to 1");
+        }
+        else
+            return fail("unknown property");
+
+        if (!valid)
+            return fail("bad value");
+    }
+
+    return finish();
+}
+
+bool ULoadSceneBinary(istream& file, const char* path, vector<GLMesh>& scene)
+{
+    auto fail = [&](const char* message) {
+        cout << "Failed to load scene " << path << ": " << message << endl;
+        return false;
+    };
+    auto failObject = [&](GLuint index, const char* message) {
+        cout << "Failed to load scene " << path << ", object " << index << ": " << message << endl;
+        return false;
+    };
+
+    SceneFileHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || header.version != SCENE_BINARY_VERSION)
+        return fail("unsupported version");
+
+    // counts and lengths are checked against what is left of the file before
+    // anything is sized from them, so a corrupt one fails here instead of
+    // allocating whatever it claims
+    const streampos position = file.tellg();
+    file.seekg(0, ios::end);
+    const uint64_t fileSize = (uint64_t)file.tellg();
+    file.seekg(position);
+    auto remaining = [&]() { return fileSize - (uint64_t)file.tellg(); };
+
+    if ((uint64_t)header.nStrings * sizeof(uint32_t) > remaining())
+        return fail("string count runs past the end of the file");
+
+    vector<const char*> strings(header.nStrings);
+    string text;
+    for (const char*& s : strings)
+    {
+        uint32_t length;
+        if (!file.read((char*)&length, sizeof(length)))
+            return fail("truncated string table");
+        if (length > remaining())
+            return fail("string runs past the end of the file");
+        text.resize(length);
+        if (length > 0 && !file.read(&text[0], length))
+            return fail("truncated string table");
+        s = USceneString(text.c_str(), length);
+    }
+
+    if ((uint64_t)header.nObjects * sizeof(SceneRecord) > remaining())
+        return fail("object count runs past the end of the file");
+
+    scene.reserve(scene.size() + header.nObjects);
+
+    // records are read a batch at a time straight into the meshes
+    const GLuint BATCH = 256;
+    SceneRecord batch[BATCH];
+    for (GLuint first = 0; first < header.nObjects; first += BATCH)
+    {
+        const GLuint count = min(BATCH, header.nObjects - first);
+        if (!file.read((char*)batch, count * sizeof(SceneRecord)))
+            return fail("truncated objects");
+
+        for (GLuint i = 0; i < count; i++)
+        {
+            const SceneRecord& record = batch[i];
+            if (record.primitive > cone || record.material > glow || record.texture >= strings.size())
+                return failObject(first + i, "bad primitive, material or texture");
+
+            GLMesh& mesh = UAddSceneMesh(scene, Primitive(record.primitive));
+            copy_n(record.p, SCENE_PARAMETERS, mesh.p.begin());
+            mesh.material = Material(record.material);
+            mesh.texFilename = strings[record.texture];
+            mesh.height = record.height;
+            mesh.length = record.length;
+            mesh.radius = record.radius;
+            mesh.innerRadius = record.innerRadius;
+            mesh.number_of_sides = record.sides;
+            mesh.transparency = record.transparency;
+            if (const char* error = USceneShapeError(mesh))
+                return failObject(first + i, error);
+            UFinishSceneMesh(mesh);
+        }
+    }
+
+    return true;
+}
+
+// Appends the objects of a scene file, text or binary, to the scene
+bool ULoadScene(const char* path, vector<GLMesh>& scene)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        cout << "Failed to open scene " << path << endl;
+        return false;
+    }
+
+    char magic[sizeof(SCENE_BINARY_MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    if (file && memcmp(magic, SCENE_BINARY_MAGIC, sizeof(magic)) == 0)
+        return ULoadSceneBinary(file, path, scene);
+
+    file.clear();
+    file.seekg(0);
+    return ULoadSceneText(file, path, scene);
+}
+
+// Writes the scene's objects in the text form. Rotations are written as
+// angles about x, y and z, the only axes the text form has.
+bool UWriteSceneText(const char* path, const vector<GLMesh>& scene)
+{
+    ofstream file(path);
+    if (!file)
+        return false;
+
+    file.precision(7);
+    for (const GLMesh& mesh : scene)
+    {
+        if (mesh.lodOf >= 0)
+            continue;
+
+        const float* p = mesh.p.data();
+        assert(p[8] == 1.0f && p[13] == 1.0f && p[18] == 1.0f && "the text form only rotates about x, y and z");
+
+        file << gScenePrimitiveKeywords[mesh.primitive] << "\n";
+        file << "    texture " << mesh.texFilename << "\n";
+        if (mesh.material != matte)
+            file << "    material " << gSceneMaterialKeywords[mesh.material] << "\n";
+        if (p[4] != 1.0f || p[5] != 1.0f || p[6] != 1.0f)
+            file << "    scale " << p[4] << " " << p[5] << " " << p[6] << "\n";
+        if (p[7] != 0.0f || p[11] != 0.0f || p[15] != 0.0f)
+            file << "    rotate " << p[7] << " " << p[11] << " " << p[15] << "\n";
+        if (p[19] != 0.0f || p[20] != 0.0f || p[21] != 0.0f)
+            file << "    translate " << p[19] << " " << p[20] << " " << p[21] << "\n";
+        if (p[22] != 1.0f || p[23] != 1.0f)
+            file << "    uv-scale " << p[22] << " " << p[23] << "\n";
+        if (mesh.height != 0.0f)
+            file << "    height " << mesh.height << "\n";
+        if (mesh.length != 0.0f)
+            file << "    length " << mesh.length << "\n";
+        if (mesh.radius != 0.0f)
+            file << "    radius " << mesh.radius << "\n";
+        if (mesh.innerRadius != 0.0f)
+            file << "    inner-radius " << mesh.innerRadius << "\n";
+        if (mesh.number_of_sides != 0.0f)
+            file << "    sides " << mesh.number_of_sides << "\n";
+        if (mesh.transparency != 1.0f)
+            file << "    transparency " << mesh.transparency << "\n";
+        file << "\n";
+    }
+
+    return bool(file);
+}
+
+// Writes the scene's objects in the binary form: a header, the texture
+// paths, then one fixed size record per object, all little-endian
+bool UWriteSceneBinary(const char* path, const vector<GLMesh>& scene)
+{
+    ofstream file(path, ios::binary);
+    if (!file)
+        return false;
+
+    map<string, uint32_t> stringIndices;
+    vector<const char*> strings;
+    vector<SceneRecord> records;
+    records.reserve(scene.size());
+    for (const GLMesh& mesh : scene)
+    {
+        if (mesh.lodOf >= 0)
+            continue;
+
+        auto added = stringIndices.insert({ mesh.texFilename, uint32_t(strings.size()) });
+        if (added.second)
+            strings.push_back(mesh.texFilename);
+
+        SceneRecord record = {};
+        record.primitive = uint8_t(mesh.primitive);
+        record.material = uint8_t(mesh.material);
+        record.texture = added.first->second;
+        copy_n(mesh.p.begin(), SCENE_PARAMETERS, record.p);
+        record.height = mesh.height;
+        record.length = mesh.length;
+        record.radius = mesh.radius;
+        record.innerRadius = mesh.innerRadius;
+        record.sides = mesh.number_of_sides;
+        record.transparency = mesh.transparency;
+        records.push_back(record);
+    }
+
+    SceneFileHeader header;
+    header.version = SCENE_BINARY_VERSION;
+    header.nStrings = strings.size();
+    header.nObjects = records.size();
+    file.write(SCENE_BINARY_MAGIC, sizeof(SCENE_BINARY_MAGIC));
+    file.write((const char*)&header, sizeof(header));
+    for (const char* s : strings)
+    {
+        const uint32_t length = strlen(s);
+        file.write((const char*)&length, sizeof(length));
+        file.write(s, length);
+    }
+    file.write((const char*)records.data(), records.size() * sizeof(SceneRecord));
+
+    return bool(file);
+}
+
+// Times loading a large synthetic scene from both forms, and checks the two
+// give the same meshes
+void UBenchmarkScene()
+{
+    const GLuint nObjects = 100000;
+    const char* textPath = "bench.scene";
+    const char* binaryPath = "bench.sceneb";
+    const char* textures[] = { "textures/wood1.png", "textures/black.png", "textures/mug1.png", "textures/lava.png" };
+    mt19937 random(330);
+
+    // values in hundredths, so the text form holds them exactly
+    auto value = [&](int low, int high) { return uniform_int_distribution<int>(low, high)(random) / 100.0f; };
+
+    vector<GLMesh> scene;
+    for (GLuint i = 0; i < nObjects; i++)
+    {
+        GLMesh& mesh = UAddSceneMesh(scene, Primitive(random() % 6));
+        const char* texture = textures[random() % 4];
+        mesh.texFilename = USceneString(texture, strlen(texture));
+        mesh.material = Material(random() % 4);
+        for (int k = 4; k < 7; k++)
+            mesh.p[k] = value(10, 300);
+        mesh.p[7] = value(-18000, 18000);
+        mesh.p[11] = value(-18000, 18000);
+        mesh.p[15] = value(-18000, 18000);
+        for (int k = 19; k < 22; k++)
+            mesh.p[k] = value(-10000, 10000);
+        mesh.height = value(10, 400);
+        mesh.radius = value(10, 100);
+        mesh.number_of_sides = float(8 + random() % 137);
+    }
+
+    if (!UWriteSceneText(textPath, scene) || !UWriteSceneBinary(binaryPath, scene))
+    {
+        cout << "Failed to write the benchmark scenes" << endl;
+        return;
+    }
+
+    auto load = [](const char* path, vector<GLMesh>& loaded) {
+        const auto start = chrono::steady_clock::now();
+        ULoadScene(path, loaded);
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+
+    vector<GLMesh> fromText, fromBinary;
+    const double textTime = load(textPath, fromText);
+    const double binaryTime = load(binaryPath, fromBinary);
+
+    bool matches = fromText.size() == nObjects && fromBinary.size() == nObjects;
+    for (GLuint i = 0; matches && i < nObjects; i++)
+    {
+        for (const GLMesh* loaded : { &fromText[i], &fromBinary[i] })
+        {
+            matches = matches && loaded->primitive == scene[i].primitive && loaded->material == scene[i].material
+                && loaded->texFilename == scene[i].texFilename && loaded->p == scene[i].p
+                && loaded->height == scene[i].height && loaded->radius == scene[i].radius
+                && loaded->number_of_sides == scene[i].number_of_sides;
+        }
+    }
+
+    auto megabytes = [](const char* path) { ifstream file(path, ios::binary | ios::ate); return file.tellg() / (1024.0 * 1024.0); };
+    cout << "BENCH: scene " << nObjects << " objects: text " << megabytes(textPath) << " MB in " << textTime << " ms"
+        << " | binary " << megabytes(binaryPath) << " MB in " << binaryTime << " ms"
+        << (matches ? "" : " (LOADED SCENES DIFFER)") << endl;
+
+    remove(textPath);
+    remove(binaryPath);
+}
+
+// Returns the ring table for a side count, building it on first use. Only
+// lookups are thread safe: UGenerateScene builds the tables a scene needs
+// before its worker threads start.
+const RingTable& URingTable(float sides)
+{
+    auto found = gRingTables.find(sides);
+    if (found != gRingTables.end())
+        return found->second;
+
+    RingTable& ring = gRingTables[sides];
+
+    constexpr double PI = 3.14159265358979323846;
+    const GLuint count = (GLuint)sides;
+
+    ring.cosines.resize(count + 2);
+    ring.sines.resize(count + 2);
+
+    for (GLuint i = 0; i < count + 2; i++)
+    {
+        const double angle = 2.0 * PI * (i % count) / count;
+        ring.cosines[i] = (float)cos(angle);
+        ring.sines[i] = (float)sin(angle);
+    }
+
+    return ring;
+}
+
+// Sizes the mesh's arrays for exactly nVertices vertices and nIndices indices
+VertexWriter UBeginVertices(GLMesh& mesh, GLuint nVertices, GLuint nIndices)
+{
+    VertexWriter out;
+#ifdef _DEBUG
+    out.allocationsBefore = gAllocationCount;
+#endif
+
+    mesh.v.resize(nVertices * FLOATS_PER_VERTEX);
+    mesh.indices.resize(nIndices);
+
+    out.vertex = mesh.v.data();
+    out.index = mesh.indices.data();
+    return out;
+}
+
+// Writes one vertex in the layout UUploadGeometry expects: position, normal
+// padded to four floats, texture coordinate
+void UPutVertex(VertexWriter& out, float x, float y, float z, float nx, float ny, float nz, float u, float v)
+{
+    float* vertex = out.vertex;
+
+    vertex[0] = x;
+    vertex[1] = y;
+    vertex[2] = z;
+    vertex[3] = nx;
+    vertex[4] = ny;
+    vertex[5] = nz;
+    vertex[6] = 1.0f;
+    vertex[7] = u;
+    vertex[8] = v;
+
+    out.vertex += FLOATS_PER_VERTEX;
+    ++out.nVertices;
+}
+
+void UPutTriangle(VertexWriter& out, GLuint a, GLuint b, GLuint c)
+{
+    out.index[0] = a;
+    out.index[1] = b;
+    out.index[2] = c;
+    out.index += 3;
+}
+
+// Writes count vertices of a ring, starting at ring point first
+void UPutRing(VertexWriter& out, const RingTable& ring, GLuint first, GLuint count, const RingSpec& shape)
+{
+    float batch[6][RING_BATCH];
+
+    // every normal of a ring is as long as (normalScale, normalY), so scaling
+    // those once gives the whole ring unit normals, whatever the radius
+    RingSpec spec = shape;
+    const float normalLength = sqrtf(spec.normalScale * spec.normalScale + spec.normalY * spec.normalY);
+    if (normalLength > 0.0f)
+    {
+        spec.normalScale /= normalLength;
+        spec.normalY /= normalLength;
+    }
+
+    for (GLuint done = 0; done < count; done += RING_BATCH)
+    {
+        const GLuint n = min(RING_BATCH, count - done);
+        gRingKernel(ring.cosines.data(), ring.sines.data(), first + done, n, spec, batch);
+
+        for (GLuint k = 0; k < n; k++)
+            UPutVertex(out, batch[0][k], spec.y, batch[1][k], batch[2][k], spec.normalY, batch[3][k], batch[4][k], batch[5][k]);
+    }
+}
+
+// Reference ring kernel, one ring point at a time. The SIMD kernels use it for
+// the points left over after their last full vector.
+void URingKernelScalar(const float* cosines, const float* sines, GLuint first, GLuint count, const RingSpec& spec, float batch[6][RING_BATCH])
+{
+    for (GLuint k = 0; k < count; k++)
+    {
+        const float c = cosines[first + k];
+        const float s = sines[first + k];
+
+        batch[0][k] = 0.5f + spec.radius * c;
+        batch[1][k] = 0.5f + spec.radius * s;
+        batch[2][k] = spec.normalScale * c;
+        batch[3][k] = spec.normalScale * s;
+        batch[4][k] = (spec.uOrigin + spec.uCos * c) + spec.uStep * (float)(first + k);
+        batch[5][k] = spec.vOrigin + spec.vSin * s;
+    }
+}
+
+#ifdef X86_SIMD
+// Four ring points per step. Multiplies and adds stay separate (no fused
+// multiply-add) so the results match the scalar kernel bit for bit.
+void URingKernelSSE(const float* cosines, const float* sines, GLuint first, GLuint count, const RingSpec& spec, float batch[6][RING_BATCH])
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 radius = _mm_set1_ps(spec.radius);
+    const __m128 normalScale = _mm_set1_ps(spec.normalScale);
+    const __m128 uOrigin = _mm_set1_ps(spec.uOrigin);
+    const __m128 uCos = _mm_set1_ps(spec.uCos);
+    const __m128 uStep = _mm_set1_ps(spec.uStep);
+    const __m128 vOrigin = _mm_set1_ps(spec.vOrigin);
+    const __m128 vSin = _mm_set1_ps(spec.vSin);
+    const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+
+    GLuint k = 0;
+    for (; k + 4 <= count; k += 4)
+    {
+        const __m128 c = _mm_loadu_ps(cosines + first + k);
+        const __m128 s = _mm_loadu_ps(sines + first + k);
+        const __m128 i = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32((int)(first + k)), lanes));
+
+        _mm_storeu_ps(batch[0] + k, _mm_add_ps(half, _mm_mul_ps(radius, c)));
+        _mm_storeu_ps(batch[1] + k, _mm_add_ps(half, _mm_mul_ps(radius, s)));
+        _mm_storeu_ps(batch[2] + k, _mm_mul_ps(normalScale, c));
+        _mm_storeu_ps(batch[3] + k, _mm_mul_ps(normalScale, s));
+        _mm_storeu_ps(batch[4] + k, _mm_add_ps(_mm_add_ps(uOrigin, _mm_mul_ps(uCos, c)), _mm_mul_ps(uStep, i)));
+        _mm_storeu_ps(batch[5] + k, _mm_add_ps(vOrigin, _mm_mul_ps(vSin, s)));
+    }
+
+    if (k < count)
+    {
+        float tail[6][RING_BATCH];
+        URingKernelScalar(cosines, sines, first + k, count - k, spec, tail);
+        for (GLuint attribute = 0; attribute < 6; attribute++)
+            memcpy(batch[attribute] + k, tail[attribute], (count - k) * sizeof(float));
+    }
+}
+
+// Eight ring points per step; same math as the SSE kernel
+TARGET_AVX2 void URingKernelAVX2(const float* cosines, const float* sines, GLuint first, GLuint count, const RingSpec& spec, float batch[6][RING_BATCH])
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 radius = _mm256_set1_ps(spec.radius);
+    const __m256 normalScale = _mm256_set1_ps(spec.normalScale);
+    const __m256 uOrigin = _mm256_set1_ps(spec.uOrigin);
+    const __m256 uCos = _mm256_set1_ps(spec.uCos);
+    const __m256 uStep = _mm256_set1_ps(spec.uStep);
+    const __m256 vOrigin = _mm256_set1_ps(spec.vOrigin);
+    const __m256 vSin = _mm256_set1_ps(spec.vSin);
+    const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    GLuint k = 0;
+    for (; k + 8 <= count; k += 8)
+    {
+        const __m256 c = _mm256_loadu_ps(cosines + first + k);
+        const __m256 s = _mm256_loadu_ps(sines + first + k);
+        const __m256 i = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32((int)(first + k)), lanes));
+
+        _mm256_storeu_ps(batch[0] + k, _mm256_add_ps(half, _mm256_mul_ps(radius, c)));
+        _mm256_storeu_ps(batch[1] + k, _mm256_add_ps(half, _mm256_mul_ps(radius, s)));
+        _mm256_storeu_ps(batch[2] + k, _mm256_mul_ps(normalScale, c));
+        _mm256_storeu_ps(batch[3] + k, _mm256_mul_ps(normalScale, s));
+        _mm256_storeu_ps(batch[4] + k, _mm256_add_ps(_mm256_add_ps(uOrigin, _mm256_mul_ps(uCos, c)), _mm256_mul_ps(uStep, i)));
+        _mm256_storeu_ps(batch[5] + k, _mm256_add_ps(vOrigin, _mm256_mul_ps(vSin, s)));
+    }
+
+    if (k < count)
+    {
+        float tail[6][RING_BATCH];
+        URingKernelScalar(cosines, sines, first + k, count - k, spec, tail);
+        for (GLuint attribute = 0; attribute < 6; attribute++)
+            memcpy(batch[attribute] + k, tail[attribute], (count - k) * sizeof(float));
+    }
+}
+
+// True when the CPU and the OS both support AVX2
+bool UCpuHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX needs the OS to save the ymm registers
+    __cpuid(info, 1);
+    const bool osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    if (!osSavesYmm)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Picks the widest ring kernel this machine can run
+void USelectRingKernel()
+{
+    gRingKernel = URingKernelScalar;
+    gRingKernelName = "scalar";
+
+#ifdef X86_SIMD
+    gRingKernel = URingKernelSSE;
+    gRingKernelName = "SSE";
+
+    if (UCpuHasAVX2())
+    {
+        gRingKernel = URingKernelAVX2;
+        gRingKernelName = "AVX2";
+    }
+#endif
+
+    cout << "INFO: Ring kernel: " << gRingKernelName << endl;
+}
+
+// Checks the generator wrote exactly what it sized for
+void UEndVertices(const GLMesh& mesh, const VertexWriter& out)
+{
+    // only the asserts read these, so release builds would warn
+    (void)mesh;
+    (void)out;
+
+    assert(out.vertex == mesh.v.data() + mesh.v.size() && "vertex count doesn't match what was written");
+    assert(out.index == mesh.indices.data() + mesh.indices.size() && "index count doesn't match what was written");
+#ifdef _DEBUG
+    assert(gAllocationCount - out.allocationsBefore == 2 && "a build allocates its vertex and index arrays once each");
+#endif
+}
+
+// Times the CPU side of each round shape's generator at a few ring resolutions
+// with every ring kernel this machine runs, and prints the average time per
+// mesh. The SIMD kernels' output is checked against the scalar one.
+void UBenchmarkGenerators()
+{
+    const float sideCounts[] = { 16.0f, 144.0f, 4096.0f };
+    void (*const generators[])(GLMesh&) = { UGenerateCircle, UGenerateCylinder, UGenerateHollowCylinder, UGenerateCone };
+    const char* const names[] = { "circle", "cylinder", "hollow cylinder", "cone" };
+    constexpr int repeats = 200;
+
+    vector<pair<RingKernel, const char*>> kernels = { { URingKernelScalar, "scalar" } };
+#ifdef X86_SIMD
+    kernels.push_back({ URingKernelSSE, "SSE" });
+    if (UCpuHasAVX2())
+        kernels.push_back({ URingKernelAVX2, "AVX2" });
+#endif
+
+    const RingKernel selectedKernel = gRingKernel;
+
+    for (float sides : sideCounts)
+    {
+        for (int g = 0; g < 4; g++)
+        {
+            vector<float> scalarVertices;
+
+            for (const auto& kernel : kernels)
+            {
+                gRingKernel = kernel.first;
+
+                double totalSeconds = 0.0;
+                bool matchesScalar = true;
+
+                for (int r = 0; r < repeats; r++)
+                {
+                    GLMesh mesh;
+                    mesh.radius = 0.5f;
+                    mesh.innerRadius = 0.45f;
+                    mesh.height = 1.0f;
+                    mesh.number_of_sides = sides;
+
+                    const auto start = chrono::steady_clock::now();
+                    generators[g](mesh);
+                    totalSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+                    if (r == 0)
+                    {
+                        if (kernel.first == URingKernelScalar)
+                            scalarVertices = mesh.v;
+                        else
+                            matchesScalar = mesh.v == scalarVertices;
+                    }
+                }
+
+                cout << "BENCH: " << names[g] << ", " << sides << " sides, " << kernel.second << ": "
+                    << totalSeconds / repeats * 1e6 << " us per mesh"
+                    << (matchesScalar ? "" : " (OUTPUT DIFFERS FROM SCALAR)") << endl;
+            }
+        }
+    }
+
+    // the compact format has to keep normal directions of shapes wider than
+    // the unit ones too, whose generated normals are longer than 1
+    for (int g = 0; g < 4; g++)
+    {
+        GLMesh mesh;
+        mesh.radius = 2.0f;
+        mesh.innerRadius = 1.8f;
+        mesh.height = 1.0f;
+        mesh.number_of_sides = 144.0f;
+        generators[g](mesh);
+
+        const float error = UPackedNormalError(mesh);
+        cout << "BENCH: " << names[g] << ", radius " << mesh.radius << ": packed normals off by up to " << error
+            << (error <= PACKED_NORMAL_TOLERANCE ? "" : " (PACKED NORMALS BENT)") << endl;
+    }
+
+    gRingKernel = selectedKernel;
+}
+
+// The triangles of a round shape as the generators drew them before they were
+// indexed: every face on its own, fans repeating their centre, in the old
+// order and winding. Ring points come from the same ring table, which closes
+// the rings, so what is compared is the indexing and not the table.
+void UReferenceRingTriangles(const GLMesh& mesh, vector<glm::vec3>& triangles)
+{
+    const RingTable& ring = URingTable(mesh.number_of_sides);
+    const GLuint sides = (GLuint)mesh.number_of_sides;
+    const float h = mesh.height;
+
+    auto point = [&](float radius, GLuint i, float y) {
+        return glm::vec3(0.5f + radius * ring.cosines[i], y, 0.5f + radius * ring.sines[i]);
+    };
+    auto triangle = [&](const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+        triangles.insert(triangles.end(), { a, b, c });
+    };
+    // one side quad between two rings of the same radius, as two triangles
+    auto wall = [&](float radius, GLuint i) {
+        triangle(point(radius, i, 0.0f), point(radius, i, h), point(radius, i + 1, h));
+        triangle(point(radius, i + 1, h), point(radius, i + 1, 0.0f), point(radius, i, 0.0f));
+    };
+    // one sector of a flat ring between the inner and outer radius
+    auto annulus = [&](GLuint i, float y) {
+        triangle(point(mesh.innerRadius, i, y), point(mesh.radius, i, y), point(mesh.innerRadius, i + 1, y));
+        triangle(point(mesh.innerRadius, i + 1, y), point(mesh.radius, i + 1, y), point(mesh.radius, i, y));
+    };
+
+    const glm::vec3 bottomCentre(0.5f, 0.0f, 0.5f);
+    const glm::vec3 topCentre(0.5f, h, 0.5f);
+
+    triangles.clear();
+    switch (mesh.primitive)
+    {
+    case circle:
+        for (GLuint i = 1; i <= sides; i++)
+            triangle(bottomCentre, point(mesh.radius, i, 0.0f), point(mesh.radius, i + 1, 0.0f));
+        break;
+    case cylinder:
+        for (GLuint i = 0; i < sides; i++)
+            triangle(bottomCentre, point(mesh.radius, i, 0.0f), point(mesh.radius, i + 1, 0.0f));
+        for (GLuint i = 1; i <= sides; i++)
+            triangle(topCentre, point(mesh.radius, i, h), point(mesh.radius, i + 1, h));
+        for (GLuint i = 0; i < sides; i++)
+            wall(mesh.radius, i);
+        break;
+    case hollowCylinder:
+        for (GLuint i = 0; i < sides; i++)
+            annulus(i, 0.0f);
+        for (GLuint i = 0; i < sides; i++)
+            annulus(i, h);
+        for (GLuint i = 0; i < sides; i++)
+            wall(mesh.radius, i);
+        for (GLuint i = 0; i < sides; i++)
+            wall(mesh.innerRadius, i);
+        break;
+    case cone:
+        for (GLuint i = 1; i <= sides; i++)
+        {
+            triangle(bottomCentre, point(mesh.radius, i, 0.0f), point(mesh.radius, i + 1, 0.0f));
+            triangle(point(mesh.radius, i, 0.0f), point(mesh.radius, i + 1, 0.0f), topCentre);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Counts, for each pixel of an orthographic view looking along direction, the
+// triangles covering its centre: front facing ones in the first half of
+// coverage, back facing ones in the second. Pixels are pixelSize wide and the
+// view's corner is at origin, in the view's right/up coordinates.
+void URasterizeCoverage(const vector<glm::vec3>& triangles, const glm::vec3& direction, const glm::vec2& origin, float pixelSize, vector<GLuint>& coverage)
+{
+    const int SIZE = 128;
+    const glm::vec3 forward = glm::normalize(direction);
+    const glm::vec3 right = glm::normalize(glm::cross(fabsf(forward.y) > 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f), forward));
+    const glm::vec3 up = glm::cross(forward, right);
+
+    coverage.assign(2 * SIZE * SIZE, 0);
+
+    for (size_t t = 0; t < triangles.size(); t += 3)
+    {
+        glm::vec2 corners[3];
+        for (int k = 0; k < 3; k++)
+            corners[k] = (glm::vec2(glm::dot(triangles[t + k], right), glm::dot(triangles[t + k], up)) - origin) / pixelSize;
+
+        const float area = (corners[1].x - corners[0].x) * (corners[2].y - corners[0].y) - (corners[2].x - corners[0].x) * (corners[1].y - corners[0].y);
+        if (area == 0.0f)
+            continue;
+
+        // wind every triangle the same way so one edge test covers both
+        if (area < 0.0f)
+            std::swap(corners[1], corners[2]);
+        GLuint* counts = coverage.data() + (area > 0.0f ? 0 : SIZE * SIZE);
+
+        const int x0 = max(0, (int)floorf(min({ corners[0].x, corners[1].x, corners[2].x })));
+        const int x1 = min(SIZE - 1, (int)ceilf(max({ corners[0].x, corners[1].x, corners[2].x })));
+        const int y0 = max(0, (int)floorf(min({ corners[0].y, corners[1].y, corners[2].y })));
+        const int y1 = min(SIZE - 1, (int)ceilf(max({ corners[0].y, corners[1].y, corners[2].y })));
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                const glm::vec2 centre(x + 0.5f, y + 0.5f);
+                bool inside = true;
+                for (int k = 0; k < 3 && inside; k++)
+                {
+                    const glm::vec2& a = corners[k];
+                    const glm::vec2& b = corners[(k + 1) % 3];
+                    inside = (b.x - a.x) * (centre.y - a.y) - (b.y - a.y) * (centre.x - a.x) >= 0.0f;
+                }
+                counts[y * SIZE + x] += inside;
+            }
+        }
+    }
+}
+
+// Rasterizes each round shape, as generated and reordered for drawing, next
+// to the triangles it was drawn with before indexing, from the six axis
+// directions and two oblique ones. Front and back facing coverage has to
+// match on all but a few edge pixels, where the two may round differently.
+bool UCheckGeneratorCoverage()
+{
+    const Primitive primitives[] = { circle, cylinder, hollowCylinder, cone };
+    const float sideCounts[] = { 3.0f, 8.0f, 144.0f };
+    const glm::vec3 directions[] = {
+        { 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f },
+        { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f },
+        { 1.0f, 1.0f, 1.0f }, { -1.0f, 0.5f, 2.0f }
+    };
+    // share of the covered pixels allowed to differ
+    const float TOLERANCE = 0.002f;
+
+    vector<glm::vec3> reference, generated;
+    vector<GLuint> referenceCoverage, generatedCoverage;
+    bool passed = true;
+
+    for (Primitive primitive : primitives)
+    {
+        for (float sides : sideCounts)
+        {
+            // a unit shape and a wide, flat one
+            for (float scale : { 1.0f, 4.0f })
+            {
+                GLMesh mesh;
+                mesh.primitive = primitive;
+                mesh.radius = 0.5f * scale;
+                mesh.innerRadius = 0.3f * scale;
+                mesh.height = 1.0f / scale;
+                mesh.number_of_sides = sides;
+                UGenerateGeometry(mesh);
+
+                generated.clear();
+                for (GLuint index : mesh.indices)
+                    generated.emplace_back(mesh.v[index * FLOATS_PER_VERTEX], mesh.v[index * FLOATS_PER_VERTEX + 1], mesh.v[index * FLOATS_PER_VERTEX + 2]);
+                UReferenceRingTriangles(mesh, reference);
+
+                GLuint covered = 0, differing = 0;
+                for (const glm::vec3& direction : directions)
+                {
+                    // frame the shape's bounding sphere
+                    const float extent = sqrtf(mesh.radius * mesh.radius * 4.0f + mesh.height * mesh.height);
+                    const glm::vec3 forward = glm::normalize(direction);
+                    const glm::vec3 right = glm::normalize(glm::cross(fabsf(forward.y) > 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f), forward));
+                    const glm::vec3 up = glm::cross(forward, right);
+                    const glm::vec3 centre(0.5f, mesh.height * 0.5f, 0.5f);
+                    const glm::vec2 origin = glm::vec2(glm::dot(centre, right), glm::dot(centre, up)) - extent * 0.5f;
+                    const float pixelSize = extent / 128.0f;
+
+                    URasterizeCoverage(reference, direction, origin, pixelSize, referenceCoverage);
+                    URasterizeCoverage(generated, direction, origin, pixelSize, generatedCoverage);
+
+                    for (size_t i = 0; i < referenceCoverage.size(); i++)
+                    {
+                        covered += referenceCoverage[i] > 0;
+                        differing += referenceCoverage[i] != generatedCoverage[i];
+                    }
+                }
+
+                const bool matches = differing <= TOLERANCE * covered;
+                passed = passed && matches;
+                cout << "CHECK: " << gPrimitiveNames[primitive] << ", " << sides << " sides, radius " << mesh.radius << ": "
+                    << differing << " of " << covered << " covered pixels differ" << (matches ? "" : " (COVERAGE DIFFERS)") << endl;
+            }
+        }
+    }
+
+    cout << "CHECK: generator coverage " << (passed ? "matches" : "DIFFERS") << endl;
+    return passed;
+}
+
+// Generates the vertices of every mesh that needs buffers of its own, spread
+// over all cores. Meshes that will share a cached or earlier mesh's geometry
+// are left empty; UUploadScene points them at the shared buffers.
+void UGenerateScene(vector<GLMesh>& scene)
+{
+    set<GeometryKey> claimed;
+    vector<GLuint> toGenerate;
+
+    for (GLuint i = 0; i < scene.size(); i++)
+    {
+        GLMesh& mesh = scene[i];
+
+        const GeometryKey key = UGeometryKey(mesh);
+        if (gGeometryCache.count(key) || !claimed.insert(key).second)
+            continue;
+
+        // the workers may only read ring tables, so build them here
+        if (mesh.primitive != cube && mesh.primitive != plane)
+            URingTable(mesh.number_of_sides);
+
+        toGenerate.push_back(i);
+    }
+
+    vector<MeshOptimizeStats> stats(toGenerate.size());
+    const GLuint nThreads = UParallelFor(toGenerate.size(), [&](GLuint n)
+    {
+        stats[n] = UGenerateGeometry(scene[toGenerate[n]]);
+    });
+
+    UMarkStartupPhase("generate " + to_string(toGenerate.size()) + " meshes on " + to_string(nThreads) + " threads");
+
+    // how much the reordering helped, averaged per primitive
+    float before[cone + 1] = {};
+    float after[cone + 1] = {};
+    GLuint count[cone + 1] = {};
+    for (GLuint n = 0; n < toGenerate.size(); n++)
+    {
+        if (stats[n].acmrBefore == 0.0f)
+            continue;
+
+        const Primitive primitive = scene[toGenerate[n]].primitive;
+        before[primitive] += stats[n].acmrBefore;
+        after[primitive] += stats[n].acmrAfter;
+        count[primitive]++;
+    }
+
+    cout << "INFO: Vertex cache ACMR (FIFO " << ACMR_CACHE_SIZE << ") before -> after";
+    const char* separator = ": ";
+    for (int p = cube; p <= cone; p++)
+    {
+        if (count[p] == 0)
+            continue;
+
+        cout << separator << gPrimitiveNames[p] << " " << before[p] / count[p] << " -> " << after[p] / count[p];
+        separator = " | ";
+    }
+    cout << endl;
+}
+
+// Uploads the generated geometry and builds the model matrices, in scene order
+// so every shared shape is uploaded before the meshes reusing it
+void UUploadScene(vector<GLMesh>& scene)
+{
+    for (GLMesh& mesh : scene)
+        UBuildMesh(mesh);
+
+    UMarkStartupPhase("upload " + to_string(gGeometryCache.size()) + " shapes");
+}
+
+// Runs body(0) .. body(count - 1) on up to one thread per core, the calling
+// thread included. Workers take the next index from a shared counter, so
+// uneven items balance out. Returns the number of threads used.
+GLuint UParallelFor(GLuint count, const function<void(GLuint)>& body)
+{
+    const GLuint nThreads = max(1u, min(count, thread::hardware_concurrency()));
+
+    atomic<GLuint> next(0);
+    auto worker = [&]()
+    {
+        for (GLuint i = next++; i < count; i = next++)
+            body(i);
+    };
+
+    vector<thread> workers;
+    for (GLuint t = 1; t < nThreads; t++)
+        workers.emplace_back(worker);
+
+    worker();
+
+    for (thread& t : workers)
+        t.join();
+
+    return nThreads;
+}
+
+// Records how long the startup phase that just finished took
+void UMarkStartupPhase(const string& name)
+{
+    const auto now = chrono::steady_clock::now();
+    gStartupPhases.push_back({ name, chrono::duration<double, milli>(now - gStartupPhaseStart).count() });
+    gStartupPhaseStart = now;
+}
+
+void UReportStartupPhases()
+{
+    double total = 0.0;
+
+    cout << "INFO: Startup:";
+    for (const auto& phase : gStartupPhases)
+    {
+        cout << " " << phase.first << " " << phase.second << " ms |";
+        total += phase.second;
+    }
+    cout << " total " << total << " ms" << endl;
+}
+
+// Fills the mesh's vertex and index arrays for its primitive and optimizes
+// them for the GPU. CPU only, so any number of meshes can be generated at
+// once on worker threads.
+MeshOptimizeStats UGenerateGeometry(GLMesh& mesh)
+{
+    switch (mesh.primitive)
+    {
+    case cube:
+        UGenerateCube(mesh);
+        break;
+    case plane:
+        UGeneratePlane(mesh);
+        break;
+    case circle:
+        UGenerateCircle(mesh);
+        break;
+    case cylinder:
+        UGenerateCylinder(mesh);
+        break;
+    case hollowCylinder:
+        UGenerateHollowCylinder(mesh);
+        break;
+    case cone:
+        UGenerateCone(mesh);
+        break;
+    }
+
+    // transparent shapes blend their triangles in the order they are drawn,
+    // so only their vertices may move
+    return UOptimizeMesh(mesh.v, FLOATS_PER_VERTEX, mesh.indices, mesh.transparency >= 1.0f);
+}
+
+// Reorders a mesh for the GPU: triangles for the post-transform vertex cache,
+// then clusters of them for less overdraw, then vertices in the order the
+// triangles first use them for fetch locality. The mesh looks the same,
+// unless it is blended, where triangle order shows; reorderTriangles = false
+// only does the last step. Plain triangle lists (no indices) share no
+// vertices and are left alone.
+MeshOptimizeStats UOptimizeMesh(vector<float>& vertices, GLuint floatsPerVertex, vector<GLuint>& indices, bool reorderTriangles)
+{
+    MeshOptimizeStats stats;
+    if (indices.empty())
+        return stats;
+
+    const GLuint nVertices = vertices.size() / floatsPerVertex;
+    stats.acmrBefore = UCacheMissRatio(indices, nVertices, ACMR_CACHE_SIZE);
+
+    if (reorderTriangles)
+    {
+        UOptimizeVertexCache(indices, nVertices);
+        UOptimizeOverdraw(indices, vertices, floatsPerVertex, ACMR_CACHE_SIZE);
+    }
+    UOptimizeVertexFetch(vertices, floatsPerVertex, indices);
+
+    stats.acmrAfter = UCacheMissRatio(indices, nVertices, ACMR_CACHE_SIZE);
+    return stats;
+}
+
+// Vertex shader runs per triangle when drawing indices through a FIFO
+// post-transform cache of cacheSize entries: 3 is no reuse at all, 0.5 the
+// ideal for a large regular grid
+float UCacheMissRatio(const vector<GLuint>& indices, GLuint nVertices, GLuint cacheSize)
+{
+    // time each vertex entered the cache; it is still in it while fewer than
+    // cacheSize misses have happened since
+    vector<GLuint> enteredAt(nVertices, 0);
+    GLuint misses = 0;
+
+    for (GLuint index : indices)
+    {
+        if (enteredAt[index] == 0 || misses - enteredAt[index] >= cacheSize)
+        {
+            ++misses;
+            enteredAt[index] = misses;
+        }
+    }
+
+    return indices.empty() ? 0.0f : misses / (indices.size() / 3.0f);
+}
+
+// Tom Forsyth's linear-speed vertex cache optimization: greedily emits the
+// triangle whose vertices score best, favouring vertices recently used (in a
+// modelled LRU cache) and vertices with few triangles left to draw.
+void UOptimizeVertexCache(vector<GLuint>& indices, GLuint nVertices)
+{
+    constexpr int cacheSize = 32;
+    const GLuint nTriangles = indices.size() / 3;
+
+    // score of a vertex from its position in the cache (-1 = not in it) and
+    // the number of its triangles not emitted yet
+    auto vertexScore = [](int cachePosition, GLuint remaining)
+    {
+        if (remaining == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 3)
+            score = powf(1.0f - (cachePosition - 3) / float(cacheSize - 3), 1.5f);
+        else if (cachePosition >= 0)
+            score = 0.75f; // the last triangle's vertices; scored lower so strips don't just continue
+
+        return score + 2.0f / sqrtf((float)remaining);
+    };
+
+    // triangles using each vertex
+    vector<GLuint> firstTriangle(nVertices + 1, 0);
+    for (GLuint index : indices)
+        firstTriangle[index + 1]++;
+    for (GLuint v = 0; v < nVertices; v++)
+        firstTriangle[v + 1] += firstTriangle[v];
+
+    vector<GLuint> vertexTriangles(indices.size());
+    vector<GLuint> remaining(nVertices, 0);
+    for (GLuint t = 0; t < nTriangles; t++)
+    {
+        for (GLuint k = 0; k < 3; k++)
+        {
+            const GLuint v = indices[t * 3 + k];
+            vertexTriangles[firstTriangle[v] + remaining[v]++] = t;
+        }
+    }
+
+    vector<int> cachePosition(nVertices, -1);
+    vector<float> score(nVertices);
+    for (GLuint v = 0; v < nVertices; v++)
+        score[v] = vertexScore(-1, remaining[v]);
+
+    vector<float> triangleScore(nTriangles);
+    for (GLuint t = 0; t < nTriangles; t++)
+        triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+
+    vector<bool> emitted(nTriangles, false);
+    vector<GLuint> output;
+    output.reserve(indices.size());
+
+    // the modelled cache, most recent first, plus room for the 3 vertices pushed in
+    vector<GLuint> cache;
+    cache.reserve(cacheSize + 3);
+
+    // the cache after each triangle, built here and swapped in; both keep their capacity
+    vector<GLuint> next;
+    next.reserve(cacheSize + 3);
+
+    GLuint scanFrom = 0;
+    int best = -1;
+
+    for (GLuint n = 0; n < nTriangles; n++)
+    {
+        // nothing in the cache to continue from: take the best triangle left
+        if (best < 0)
+        {
+            while (emitted[scanFrom])
+                ++scanFrom;
+
+            best = scanFrom;
+            for (GLuint t = scanFrom; t < nTriangles; t++)
+            {
+                if (!emitted[t] && triangleScore[t] > triangleScore[best])
+                    best = t;
+            }
+        }
+
+        emitted[best] = true;
+        next.clear();
+
+        for (GLuint k = 0; k < 3; k++)
+        {
+            const GLuint v = indices[best * 3 + k];
+            output.push_back(v);
+            next.push_back(v);
+
+            // the triangle is done, drop it from the vertex's list
+            GLuint* begin = &vertexTriangles[firstTriangle[v]];
+            GLuint* end = begin + remaining[v];
+            *find(begin, end, (GLuint)best) = *(end - 1);
+            --remaining[v];
+        }
+
+        for (GLuint v : cache)
+        {
+            if (find(next.begin(), next.end(), v) == next.end())
+                next.push_back(v);
+        }
+
+        // rescore everything that was in the cache, including vertices that just fell out
+        for (GLuint i = 0; i < next.size(); i++)
+        {
+            const GLuint v = next[i];
+            cachePosition[v] = i < (GLuint)cacheSize ? i : -1;
+            score[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+
+        if (next.size() > (size_t)cacheSize)
+            next.resize(cacheSize);
+        cache.swap(next);
+
+        // best triangle among those touching the cache
+        best = -1;
+        float bestScore = -1.0f;
+        for (GLuint v : cache)
+        {
+            for (GLuint i = 0; i < remaining[v]; i++)
+            {
+                const GLuint t = vertexTriangles[firstTriangle[v] + i];
+                triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+                if (triangleScore[t] > bestScore)
+                {
+                    best = t;
+                    bestScore = triangleScore[t];
+                }
+            }
+        }
+    }
+
+    indices.swap(output);
+}
+
+// Cuts the cache-ordered triangles into clusters wherever the FIFO cache
+// restarts (a triangle missing on all 3 vertices), so moving clusters around
+// barely changes the ACMR. Clusters facing away from the mesh centre are drawn
+// first: on a convex-ish shape they are the ones in front, so early-z rejects
+// more of what comes after.
+void UOptimizeOverdraw(vector<GLuint>& indices, const vector<float>& vertices, GLuint floatsPerVertex, GLuint cacheSize)
+{
+    const GLuint nVertices = vertices.size() / floatsPerVertex;
+    const GLuint nTriangles = indices.size() / 3;
+
+    auto position = [&](GLuint v)
+    {
+        return glm::vec3(vertices[v * floatsPerVertex], vertices[v * floatsPerVertex + 1], vertices[v * floatsPerVertex + 2]);
+    };
+
+    // cluster boundaries
+    vector<GLuint> clusterStart;
+    vector<GLuint> enteredAt(nVertices, 0);
+    GLuint misses = 0;
+    for (GLuint t = 0; t < nTriangles; t++)
+    {
+        GLuint triangleMisses = 0;
+        for (GLuint k = 0; k < 3; k++)
+        {
+            const GLuint v = indices[t * 3 + k];
+            if (enteredAt[v] == 0 || misses - enteredAt[v] >= cacheSize)
+            {
+                ++misses;
+                enteredAt[v] = misses;
+                ++triangleMisses;
+            }
+        }
+
+        if (t == 0 || triangleMisses == 3)
+            clusterStart.push_back(t);
+    }
+    clusterStart.push_back(nTriangles);
+
+    const GLuint nClusters = clusterStart.size() - 1;
+    if (nClusters < 2)
+        return;
+
+    // area weighted centre of the mesh
+    glm::vec3 meshCentre(0.0f);
+    float meshArea = 0.0f;
+    for (GLuint t = 0; t < nTriangles; t++)
+    {
+        const glm::vec3 a = position(indices[t * 3]), b = position(indices[t * 3 + 1]), c = position(indices[t * 3 + 2]);
+        const float area = glm::length(glm::cross(b - a, c - a));
+        meshCentre += (a + b + c) * (area / 3.0f);
+        meshArea += area;
+    }
+    if (meshArea > 0.0f)
+        meshCentre /= meshArea;
+
+    // how far each cluster faces out from the centre
+    vector<pair<float, GLuint>> order(nClusters);
+    for (GLuint i = 0; i < nClusters; i++)
+    {
+        glm::vec3 centre(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (GLuint t = clusterStart[i]; t < clusterStart[i + 1]; t++)
+        {
+            const glm::vec3 a = position(indices[t * 3]), b = position(indices[t * 3 + 1]), c = position(indices[t * 3 + 2]);
+            const glm::vec3 cross = glm::cross(b - a, c - a);
+            const float triangleArea = glm::length(cross);
+            centre += (a + b + c) * (triangleArea / 3.0f);
+            normal += cross;
+            area += triangleArea;
+        }
+
+        const float normalLength = glm::length(normal);
+        if (area > 0.0f && normalLength > 0.0f)
+            order[i].first = -glm::dot(centre / area - meshCentre, normal / normalLength);
+        order[i].second = i;
+    }
+
+    stable_sort(order.begin(), order.end(),
+        [](const pair<float, GLuint>& a, const pair<float, GLuint>& b) { return a.first < b.first; });
+
+    vector<GLuint> output;
+    output.reserve(indices.size());
+    for (const auto& cluster : order)
+        output.insert(output.end(), indices.begin() + clusterStart[cluster.second] * 3, indices.begin() + clusterStart[cluster.second + 1] * 3);
+
+    indices.swap(output);
+}
+
+// Renumbers the vertices in the order the indices first reach them, so the
+// vertex fetch walks through memory forwards. Unused vertices go last.
+void UOptimizeVertexFetch(vector<float>& vertices, GLuint floatsPerVertex, vector<GLuint>& indices)
+{
+    const GLuint nVertices = vertices.size() / floatsPerVertex;
+    constexpr GLuint unassigned = ~0u;
+
+    vector<GLuint> remap(nVertices, unassigned);
+    GLuint next = 0;
+    for (GLuint& index : indices)
+    {
+        if (remap[index] == unassigned)
+            remap[index] = next++;
+        index = remap[index];
+    }
+    for (GLuint& target : remap)
+    {
+        if (target == unassigned)
+            target = next++;
+    }
+
+    vector<float> output(vertices.size());
+    for (GLuint v = 0; v < nVertices; v++)
+        copy_n(vertices.begin() + v * floatsPerVertex, floatsPerVertex, output.begin() + remap[v] * floatsPerVertex);
+
+    vertices.swap(output);
+}
+
+// Gives the mesh its GPU buffers, shared from the geometry cache or uploaded
+// from its vertices (generated here if that hasn't happened yet), and its
+// model matrix. Context thread only.
+void UBuildMesh(GLMesh& mesh)
+{
+    if (!UAcquireCachedGeometry(mesh) && mesh.v.empty())
+        UGenerateGeometry(mesh);
+
+    UTranslator(mesh);
+}
+
+void UGenerateCube(GLMesh& mesh)
+{
+    mesh.v = {
+        0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	0.5f,	// front left
+        -0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	0.5f,
+        -0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	1.0f,
+
+        0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	0.5f,	// front right
+        0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	1.0f,
+        -0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	1.0f,
+
+
+        0.5f,	0.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	0.5f,	// right front
+        0.5f,	1.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	1.0f,
+        0.5f,	1.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	1.0f,
+
+        0.5f,	0.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	0.5f,	// right back
+        0.5f,	0.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	0.5f,
+        0.5f,	1.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	1.0f,
+
+
+        0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	0.5f,	// back left
+        -0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	0.5f,
+        -0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	1.0f,
+
+        0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	0.5f,	// back right
+        0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	1.0f,
+        -0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	1.0f,
+
+
+        -0.5f,	0.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	0.5f,	// left back
+        -0.5f,	1.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	1.0f,
+        -0.5f,	1.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	1.0f,
+
+        -0.5f,	0.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	0.5f,	// left front
+        -0.5f,	0.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	0.5f,
+        -0.5f,	1.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	1.0f,
+
+
+
+
+        -0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// top left
+        -0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.5f,
+        0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+
+        -0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.5f,	// top right
+        0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+        0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.5f,
+
+        -0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// bottom left
+        -0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.5f,
+        0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+
+        -0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.5f,	// bottom right
+        0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+        0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.5f,
+
     };
-    con_mesh_00.height = 1.8f;
-    con_mesh_00.radius = 0.5f;
-    con_mesh_00.length = 0.5f;
-    con_mesh_00.number_of_sides = 144.0f;
-    con_mesh_00.texFilename = "textures/blacksparkle.png";
-    con_mesh_00.material = gloss;
+}
+
+// Fills the mesh's vertex and index arrays; CPU only, nothing is uploaded
+void UGenerateCircle(GLMesh& mesh)
+{
+    float r = mesh.radius;
+    float s = mesh.number_of_sides;
+
+    const RingTable& ring = URingTable(s);
+    const GLuint sides = (GLuint)s;
+
+    // center plus a rim of sides + 1 points; one triangle per sector
+    VertexWriter out = UBeginVertices(mesh, sides + 2, 3 * sides);
+
+    // center of the triangle fan, shared by every sector
+    UPutVertex(out, 0.5f, 0.0f, 0.5f, 0.0f, 1.0f, 0.0f, 0.5f, 0.5f);			// origin (0.5, 0.5) works best for textures
+
+    // rim of the fan; ring point i is vertex i. The normal leans outward, toward the ring point
+    UPutRing(out, ring, 1, sides + 1, { r, 0.0f, 2.0f * r, 1.0f, 0.5f, 0.5f, 0.0f, 0.5f, 0.5f });
+
+    // triangle fan, top
+    for (GLuint i = 1; i < sides + 1; i++)
+        UPutTriangle(out, 0, i, i + 1);
+
+    UEndVertices(mesh, out);
+}
+
+// Fills the mesh's vertex and index arrays; CPU only, nothing is uploaded
+void UGenerateHollowCylinder(GLMesh& mesh)
+{
+    float ir = mesh.innerRadius;
+    float r = mesh.radius;
+    float h = mesh.height;
+    float s = mesh.number_of_sides;
+
+    const RingTable& ring = URingTable(s);
+    const GLuint sides = (GLuint)s;
+
+    // Every ring below holds s + 1 points (0..s) and each sector i joins point i
+    // to point i + 1, so a ring's first vertex is all a sector needs to find its corners.
+    const GLuint ringSize = sides + 1;
+
+    // two rings at each end plus two rings on each wall; each sector has two
+    // quads on the ends and two on the walls
+    VertexWriter out = UBeginVertices(mesh, 8 * ringSize, 24 * sides);
+
+    // FOR TEXTURE COORDS
+    // use distance formula
+    // x2 = x1 + d * cos(theta)
+    // y2 = y1 + d * sin(theta)
+    //
+    // x1 = 0.5, d = 0.5 for outer radius, always; d = (inner radius / outer radius * 0.5)
+    // theta = 2 pi * i / sides, looked up in the ring table
+    //
+    // y1 = 0.125, d = 0.125 for outer radius, always; d = (inner radius / outer radius * 0.125)
+    // theta = 2 pi * i / sides, looked up in the ring table
+    //
+
+    // BOTTOM AND TOP OF HOLLOW CYLINDER: an inner and an outer ring at each end
+    GLuint capBase[2];
+    for (auto cap = 0; cap < 2; cap++)
+    {
+        const float y = cap == 0 ? 0.0f : h;
+        const float ny = cap == 0 ? -1.0f : 1.0f;
+
+        capBase[cap] = out.nVertices;
+
+        // inner ring
+        UPutRing(out, ring, 0, ringSize, { ir, y, -2.0f * r, ny, 0.5f, ir / r * 0.5f, 0.0f, 0.125f, ir / r * 0.125f });
+
+        // outer ring; texture adds the origin for proper alignment
+        UPutRing(out, ring, 0, ringSize, { r, y, 2.0f * r, ny, 0.5f, 0.5f, 0.0f, 0.125f, 0.125f });
+    }
+
+    constexpr float x = 1.0f;
+    float j = 1.0f / (s / x);	// for calculating texture location; change 'x' to increase or decrease how many times the texture wraps around the cylinder
+
+    // SIDES OF HOLLOW CYLINDER: a bottom and a top ring for the outside, then for the inside.
+    // The inside continues the texture where the outside left off.
+    GLuint sideBase[2];
+    for (auto side = 0; side < 2; side++)
+    {
+        const float sr = side == 0 ? r : ir;
+        const float facing = side == 0 ? 1.0f : -1.0f;
+        const float k = side == 0 ? 0.0f : 1.0f;	// for texture clamping
+
+        sideBase[side] = out.nVertices;
+
+        for (auto row = 0; row < 2; row++)
+        {
+            const float y = row == 0 ? 0.0f : h;
+            const float ty = row == 0 ? 0.25f : 0.75f;
+
+            UPutRing(out, ring, 0, ringSize, { sr, y, facing * 2.0f * r, 0.0f, k, 0.0f, j, ty, 0.0f });
+        }
+    }
+
+    for (GLuint i = 0; i < sides; i++)
+    {
+        // bottom then top annulus
+        for (auto cap = 0; cap < 2; cap++)
+        {
+            const GLuint inner = capBase[cap] + i;
+            const GLuint outer = inner + ringSize;
+
+            UPutTriangle(out, inner, outer, inner + 1);
+            UPutTriangle(out, inner + 1, outer + 1, outer);
+        }
+
+        // outside then inside wall
+        for (auto side = 0; side < 2; side++)
+        {
+            const GLuint bottom = sideBase[side] + i;
+            const GLuint top = bottom + ringSize;
+
+            UPutTriangle(out, bottom, top, top + 1);
+            UPutTriangle(out, top + 1, bottom + 1, bottom);
+        }
+    }
+
+    UEndVertices(mesh, out);
+}
+
+// Fills the mesh's vertex and index arrays; CPU only, nothing is uploaded
+void UGenerateCylinder(GLMesh& mesh)
+{
+    float r = mesh.radius;
+    float h = mesh.height;
+    float s = mesh.number_of_sides;
+
+
+    const RingTable& ring = URingTable(s);
+    const GLuint sides = (GLuint)s;
+    const GLuint ringSize = sides + 1;
+
+    // a center and a ring for each fan plus two rings for the sides; each
+    // sector has a triangle in each fan and a quad on the side
+    VertexWriter out = UBeginVertices(mesh, 4 * ringSize + 2, 12 * sides);
+
+    // triangle fan, bottom: center, then ring points 0..s
+    const GLuint bottomCenter = out.nVertices;
+    UPutVertex(out, 0.5f, 0.0f, 0.5f, 0.0f, -1.0f, 0.0f, 0.5f, 0.125f);			// origin (0.5, 0.5) works best for textures
+    UPutRing(out, ring, 0, ringSize, { r, 0.0f, 2.0f * r, -1.0f, 0.5f, 0.5f, 0.0f, 0.125f, 0.125f });		// texture adds the origin for proper alignment
+
+    // triangle fan, top: center, then ring points 1..s + 1
+    const GLuint topCenter = out.nVertices;
+    UPutVertex(out, 0.5f, h, 0.5f, 0.0f, 1.0f, 0.0f, 0.5f, 0.875f);			// origin (0.5, 0.5) works best for textures
+    UPutRing(out, ring, 1, ringSize, { r, h, 2.0f * r, 1.0f, 0.5f, 0.5f, 0.0f, 0.875f, 0.125f });		// build this fan the 'h' value away from the other fan
+
+    // since all side triangles have the same points as the fans above, the same calculations are used
+    // to wrap the texture around the cylinder, the calculated points are used to determine which section of
+    // the texture to clamp to the corresponding point.
+    constexpr float x = 1.0f;
+    float j = 1.0f / (s / x);	// for calculating texture location; change 'x' to increase or decrease how many times the texture wraps around the cylinder
 
-    UBuildCone(con_mesh_00);
-    scene.push_back(con_mesh_00);
+    // sides: a bottom and a top ring of points 0..s
+    const GLuint sideBase = out.nVertices;
+    for (auto row = 0; row < 2; row++)
+    {
+        const float y = row == 0 ? 0.0f : h;
+        const float ty = row == 0 ? 0.25f : 0.75f;
 
+        UPutRing(out, ring, 0, ringSize, { r, y, 2.0f * r, 0.0f, 0.0f, 0.0f, j, ty, 0.0f });
+    }
 
+    for (GLuint i = 0; i < sides; i++)
+    {
+        const GLuint bottom = sideBase + i;
+        const GLuint top = bottom + ringSize;
 
-    // CONE - Top Glass of Lava Lamp
-    GLMesh con_mesh_01;
-    con_mesh_01.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        1.0f, 1.0f, 1.0f,					// scale x, y, z
-        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 2.0f,					// translate x, y, z
-        1.0f, 1.0f
-    };
-    con_mesh_01.height = 1.8f;
-    con_mesh_01.radius = 0.5f;
-    con_mesh_01.length = 0.5f;
-    con_mesh_01.number_of_sides = 144.0f;
-    con_mesh_01.texFilename = "textures/lava.png";
-    con_mesh_01.transparency = 0.7f;
-    con_mesh_01.material = glow;
-    lightSources.push_back(true);
-    con_mesh_01.lightSourceId = lightSources.size() - 1;
+        UPutTriangle(out, bottomCenter, bottomCenter + 1 + i, bottomCenter + 2 + i);
+        UPutTriangle(out, topCenter, topCenter + 1 + i, topCenter + 2 + i);
+        UPutTriangle(out, bottom, top, top + 1);
+        UPutTriangle(out, top + 1, bottom + 1, bottom);
+    }
 
-    UBuildCone(con_mesh_01);
-    scene.push_back(con_mesh_01);
+    UEndVertices(mesh, out);
+}
 
 
+// Fills the mesh's vertex and index arrays; CPU only, nothing is uploaded
+void UGenerateCone(GLMesh& mesh)
+{
+    float r = mesh.radius;
+    float h = mesh.height;
+    float s = mesh.number_of_sides;
 
-    // CONE - Lower Glass of Lava Lamp
-    GLMesh con_mesh_02;
-    con_mesh_02.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        1.0f, 1.0f, 1.0f,					// scale x, y, z
-        180.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 3.0f,					// translate x, y, z
-        1.0f, 1.0f
-    };
-    con_mesh_02.height = 0.5f;
-    con_mesh_02.radius = 0.5f;
-    con_mesh_02.length = 0.5f;
-    con_mesh_02.number_of_sides = 144.0f;
-    con_mesh_02.texFilename = "textures/blacksparkle.png";
-    con_mesh_02.material = gloss;
-    UBuildCone(con_mesh_02);
-    scene.push_back(con_mesh_02);
-
-    // CONE - Base of Lava Lamp
-    GLMesh con_mesh_03;
-    con_mesh_03.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        1.0f, 1.0f, 1.0f,					// scale x, y, z
-        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.0f, -1.0f, 2.0f,					// translate x, y, z
-        1.0f, 1.0f
-    };
-    con_mesh_03.height = 1.0f;
-    con_mesh_03.radius = 0.5f;
-    con_mesh_03.length = 0.5f;
-    con_mesh_03.number_of_sides = 144.0f;
-    con_mesh_03.texFilename = "textures/blacksparkle.png";
-    con_mesh_03.material = gloss;
-    UBuildCone(con_mesh_03);
-    scene.push_back(con_mesh_03);
-
-    //------------------------------------------------------- END LAVA LAMP ------------------------------------------------------------------------
-
-    //------------------------------------------------------- COFFEE MUG ----------------------------------------------------------------------
-
-    GLMesh hollow_cyl;
-    hollow_cyl.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.8f,	0.8f,	0.8f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        -30.0f,	0.0f,	1.0f,	0.0f,
-        0.0f,	0.0f,	0.0f,	1.0f,
-        -1.0f,	-1.0f,	1.1f,
-        1.0f,	1.0f
-    };
-    hollow_cyl.texFilename = "textures/mug1.png";
-    hollow_cyl.innerRadius = 0.45f;
-    hollow_cyl.radius = 0.5f;
-    hollow_cyl.height = 1.0f;
-    hollow_cyl.number_of_sides = 144.0f;
-    hollow_cyl.material = gloss;
-    UBuildHollowCylinder(hollow_cyl);
-    scene.push_back(hollow_cyl);
-
-    GLMesh handle_cyl;
-    handle_cyl.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.3f,	0.1f,	0.4f,
-        90.0f,	1.0f,	0.0f,	0.0f,
-        0.0f,	0.0f,	1.0f,	0.0f,
-        -60.0f,	0.0f,	0.0f,	1.0f,
-        -1.2f,	-0.35f,	2.15f,
-        1.0f,	1.0f
-    };
-    handle_cyl.texFilename = "textures/mug2.png";
-    handle_cyl.innerRadius = 0.35f;
-    handle_cyl.radius = 0.5f;
-    handle_cyl.height = 1.0f;
-    handle_cyl.number_of_sides = 144.0f;
-    handle_cyl.material = gloss;
-    UBuildHollowCylinder(handle_cyl);
-    scene.push_back(handle_cyl);
-
-    GLMesh coffee;
-    coffee.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.8f,	0.8f,	0.8f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        180.0f,	0.0f,	1.0f,	0.0f,
-        0.0f,	0.0f,	0.0f,	1.0f,
-        -0.47f,	-0.4f,	2.05f,
-        1.0f,	1.0f
-    };
-    coffee.radius = 0.45f;
-    coffee.number_of_sides = 144.0f;
-    coffee.material = satin;
-    coffee.texFilename = "textures/coffee1.png";
-    UBuildCircle(coffee);
-    scene.push_back(coffee);
-
-    //------------------------------------------------------- PENCIL GLASS ----------------------------------------------------------------------
-
-    GLMesh hollow_cyl2;
-    hollow_cyl2.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.5f,	0.8f,	0.5f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        -30.0f,	0.0f,	1.0f,	0.0f,
-        0.0f,	0.0f,	0.0f,	1.0f,
-        -0.8f,	-1.0f,	-3.0f,
-        1.0f,	1.0f
-    };
-    hollow_cyl2.texFilename = "textures/glass1.png";
-    hollow_cyl2.innerRadius = 0.45f;
-    hollow_cyl2.radius = 0.5f;
-    hollow_cyl2.height = 1.0f;
-    hollow_cyl2.number_of_sides = 144.0f;
-    hollow_cyl2.material = gloss;
-    hollow_cyl2.transparency = 0.4f;
-    UBuildHollowCylinder(hollow_cyl2);
-    scene.push_back(hollow_cyl2);
-
-    GLMesh cyl_gMesh01;
-	cyl_gMesh01.p = {
-		1.0f, 1.0f, 1.0f, 1.0f,
-		0.06f, 0.3f, 0.06f,
-		-25.0f, 1.0f, 0.0f, 0.0f,
-		0.0f, 0.0f, 1.0f, 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f,
-		-0.8f, -1.0f, -2.5f,
-		1.0f, 1.0f
-	};
-	cyl_gMesh01.height = 4.0f;
-	cyl_gMesh01.radius = 0.5f;
-	cyl_gMesh01.number_of_sides = 128.0f;
-	cyl_gMesh01.texFilename = "textures/pencil1.png";
-	UBuildCylinder(cyl_gMesh01);
-	scene.push_back(cyl_gMesh01);
-
-    GLMesh cyl_gMesh02;
-    cyl_gMesh02.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,
-        0.06f, 0.3f, 0.06f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        -20.0f, 0.0f, 0.0f, 1.0f,
-        -0.85f, -1.0f, -2.7f,
-        1.0f, 1.0f
-    };
-    cyl_gMesh02.height = 4.0f;
-    cyl_gMesh02.radius = 0.5f;
-    cyl_gMesh02.number_of_sides = 128.0f;
-    cyl_gMesh02.texFilename = "textures/pencil2.png";
-    UBuildCylinder(cyl_gMesh02);
-    scene.push_back(cyl_gMesh02);
+    const RingTable& ring = URingTable(s);
+    const GLuint sides = (GLuint)s;
+    const float textStep = 1.0f / s;
 
+    // bottom center and rim, side rim and one peak per sector; each sector
+    // has a triangle in the bottom fan and one on the side
+    VertexWriter out = UBeginVertices(mesh, 3 * sides + 3, 6 * sides);
 
+    // triangle fan, bottom: center, then ring points 1..s + 1
+    UPutVertex(out, 0.5f, 0.0f, 0.5f, 0.0f, -1.0f, 0.0f, 0.5f, 0.25f);		// center point; x, y, z, normal, texture x, texture y
+    UPutRing(out, ring, 1, sides + 1, { r, 0.0f, 2.0f * r, -1.0f, 0.5f, r, 0.0f, 0.25f, 0.25f });	// texture adds the origin for proper alignment
 
-    //------------------------------------------------------------ DESK ----------------------------------------------------------------------------
+    // sides: ring points 1..s + 1, texture running along the bottom edge
+    const GLuint sideBase = out.nVertices;
+    UPutRing(out, ring, 1, sides + 1, { r, 0.0f, 2.0f * r, 1.0f, -textStep, 0.0f, textStep, 0.0f, 0.0f });
 
+    // the peak can't be shared: each side triangle samples a different spot of the texture.
+    // The peaks are a ring of radius 0 sitting on the origin.
+    const GLuint peakBase = out.nVertices;
+    UPutRing(out, ring, 1, sides, { 0.0f, h, 2.0f * r, 1.0f, -textStep + (textStep / 2), 0.0f, textStep, 1.0f, 0.0f });
 
-    GLMesh desk_gMesh01;
-    desk_gMesh01.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        2.6f,	0.07f,	3.3f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        0.0f,	0.0f,	1.0f,	0.0f,
-        30.0f,	0.0f,	0.0f,	1.0f,
-        0.0f,	-0.32,	-0.5f,
-        1.0f,	1.0f
-    };
-    desk_gMesh01.texFilename = "textures/lightboard.png";
-    desk_gMesh01.material = satin;
-    UBuildCube(desk_gMesh01);
-    scene.push_back(desk_gMesh01);
-
-    GLMesh desk_gMesh02;
-    desk_gMesh02.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.1f,	1.15f,	0.1f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        0.0f,	0.0f,	1.0f,	0.0f,
-        30.0f,	0.0f,	0.0f,	1.0f,
-        1.0f,	-1.0f,	1.0f,
-        1.0f,	1.0f
-    };
-    desk_gMesh02.texFilename = "textures/black.png";
-    desk_gMesh02.material = satin;
-    UBuildCube(desk_gMesh02);
-    scene.push_back(desk_gMesh02);
-
-    GLMesh desk_gMesh03;
-    desk_gMesh03.p = {
-        1.0f,	1.0f,	1.0f,	1.0f,
-        0.1f,	1.15f,	0.1f,
-        0.0f,	1.0f,	0.0f,	0.0f,
-        0.0f,	0.0f,	1.0f,	0.0f,
-        30.0f,	0.0f,	0.0f,	1.0f,
-        1.0f,	-1.0f,	-2.0f,
-        1.0f,	1.0f
-    };
-    desk_gMesh03.texFilename = "textures/black.png";
-    desk_gMesh03.material = satin;
-    UBuildCube(desk_gMesh03);
-    scene.push_back(desk_gMesh03);
+    for (GLuint i = 0; i < sides; i++)
+    {
+        // triangle fan, bottom
+        UPutTriangle(out, 0, 1 + i, 2 + i);
+
+        // side triangle + point
+        UPutTriangle(out, sideBase + i, sideBase + i + 1, peakBase + i);
+    }
+
+    UEndVertices(mesh, out);
+}
 
-    GLMesh paper_gMesh01;
-    paper_gMesh01.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        1.0f, 1.0f, 0.75f,					// scale x, y, z
-        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        30.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.0f, -0.22f, -0.2f,					// translate x, y, z
-        1.0f, 1.0f
-    };
 
+void UGeneratePlane(GLMesh& mesh)
+{
+    mesh.v = {
+
+        -1.0f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	// 0
+         0.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 1
+        -1.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// 2
 
+        -1.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	// 0
+         0.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 2
+         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
 
-    paper_gMesh01.texFilename = "textures/drawing3.png";
-    paper_gMesh01.gUVScale = glm::vec2(0.5f);
-    UBuildPlane(paper_gMesh01);
-    scene.push_back(paper_gMesh01);
+         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
+         0.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 2
+         1.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	0.0f,	// 5
+
+         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
+         1.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	0.0f,	// 5
+         1.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	1.0f,	// 4
 
-    GLMesh pencil_gMesh01;
-    pencil_gMesh01.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,
-        0.06f, 0.3f, 0.06f,
-        90.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        20.0f, 0.0f, 0.0f, 1.0f,
-        -1.3f, -0.9f, -2.0f,
-        1.0f, 1.0f
-    };
-    pencil_gMesh01.height = 4.0f;
-    pencil_gMesh01.radius = 0.5f;
-    pencil_gMesh01.number_of_sides = 128.0f;
-    pencil_gMesh01.texFilename = "textures/pencil2.png";
-    UBuildCylinder(pencil_gMesh01);
-    scene.push_back(pencil_gMesh01);
-
-  
-    GLMesh con_mesh_04;
-    con_mesh_04.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        0.06f, 0.2f, 0.06f,					// scale x, y, z
-        90.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        -160.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        -1.244f, -0.9f, -1.98f,					// translate x, y, z
-        1.0f, 1.0f
     };
-    con_mesh_04.height = 1.0f;
-    con_mesh_04.radius = 0.5f;
-    con_mesh_04.length = 0.5f;
-    con_mesh_04.number_of_sides = 144.0f;
-    con_mesh_04.texFilename = "textures/penciltip1.png";
-    UBuildCone(con_mesh_04);
-    scene.push_back(con_mesh_04);
+}
 
 
 
+// Cache key of a mesh; parameters the primitive ignores are left out so they
+// can't split the cache
+GeometryKey UGeometryKey(const GLMesh& mesh)
+{
+    GeometryKey key = { mesh.primitive, 0.0f, 0.0f, 0.0f, 0.0f, mesh.transparency < 1.0f };
+
+    switch (mesh.primitive)
+    {
+    case hollowCylinder:
+        key.innerRadius = mesh.innerRadius;
+        // fall through
+    case cylinder:
+    case cone:
+        key.height = mesh.height;
+        // fall through
+    case circle:
+        key.radius = mesh.radius;
+        key.number_of_sides = mesh.number_of_sides;
+        break;
+    default:
+        break;
+    }
 
+    return key;
+}
 
-    //------------------------------------------------------- BASE PLANE ---------------------------------------------------------------------------
+// Points the mesh at already uploaded buffers for the same shape, if there are
+// any. Returns false when the shape still has to be generated.
+bool UAcquireCachedGeometry(GLMesh& mesh)
+{
+    auto it = gGeometryCache.find(UGeometryKey(mesh));
+    if (it == gGeometryCache.end())
+        return false;
 
-    GLMesh plan_gMesh01;
-    plan_gMesh01.p = {
-        1.0f, 1.0f, 1.0f, 1.0f,				// color r, g, b a
-        2.0f, 6.0f, 3.0f,					// scale x, y, z
-        0.0f, 1.0f, 0.0f, 0.0f,				// x amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 1.0f, 0.0f,				// y amount of rotation, rotate x, y, z
-        0.0f, 0.0f, 0.0f, 1.0f,				// z amount of rotation, rotate x, y, z
-        0.0f, -1.0f, 0.0f,					// translate x, y, z
-        1.0f, 1.0f
-    };
+    GLGeometry& geometry = it->second;
+    geometry.refCount++;
+
+    mesh.vao = geometry.vao;
+    mesh.vbos[0] = geometry.vbos[0];
+    mesh.vbos[1] = geometry.vbos[1];
+    mesh.baseVertex = geometry.baseVertex;
+    mesh.firstIndex = geometry.firstIndex;
+    mesh.nVertices = geometry.nVertices;
+    mesh.nIndices = geometry.nIndices;
+    mesh.indexType = geometry.indexType;
+    mesh.geometryId = geometry.geometryId;
+    mesh.boundsMin = geometry.boundsMin;
+    mesh.boundsMax = geometry.boundsMax;
+    mesh.boundsRadius = geometry.boundsRadius;
+    return true;
+}
+
+// Buffers shared through the geometry cache are only freed by their last user
+void UDestroyMesh(GLMesh& mesh)
+{
+    auto it = gGeometryCache.find(UGeometryKey(mesh));
+    if (it != gGeometryCache.end() && it->second.geometryId == mesh.geometryId)
+    {
+        if (--it->second.refCount > 0)
+            return;
+
+        gGeometryCache.erase(it);
+    }
+
+    // pick data goes with the last user of the shape
+    if (gGeometryCache.count(UGeometryKey(mesh)) == 0)
+        gPickGeometry.erase(UGeometryKey(mesh));
+
+    // hand the ranges back to the arena, or drop the mesh's own buffers
+    if (mesh.vao == gArena.vao)
+    {
+        UArenaFree(gArena.freeVertices, mesh.baseVertex, mesh.nVertices);
+        UArenaFree(gArena.freeIndices, mesh.firstIndex, mesh.nIndices);
+        return;
+    }
+
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(2, mesh.vbos);
+}
+
+
+// Implements the UCreateShaders function
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLShaderProgram& program)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
+    // Create a Shader program object.
+    GLuint& programId = program.id;
+    programId = glCreateProgram();
+
+    // Create the vertex and fragment shader objects
+    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
+    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+
+    // Retrive the shader source
+    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
+    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+
+    // Compile the vertex shader, and print compilation errors (if any)
+    glCompileShader(vertexShaderId); // compile the vertex shader
+    // check for shader compile errors
+    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
+        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    glCompileShader(fragmentShaderId); // compile the fragment shader
+    // check for shader compile errors
+    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
 
-    plan_gMesh01.texFilename = "textures/wood1.png";
+        return false;
+    }
 
-    UBuildPlane(plan_gMesh01);
-    scene.push_back(plan_gMesh01);
+    // Attached compiled shaders to the shader program
+    glAttachShader(programId, vertexShaderId);
+    glAttachShader(programId, fragmentShaderId);
 
+    glLinkProgram(programId);   // links the shader program
+    // check for linking errors
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 
+        return false;
+    }
 
+    glUseProgram(programId);    // Uses the shader program
 
+    // Look every uniform up now; the render loop only uses the cached locations
+    UResolveUniforms(program);
 
+    return true;
+}
 
+// Resolves the location of every uniform the render loop sets. Uniforms a program
+// does not declare resolve to -1, which glUniform* silently ignores.
+void UResolveUniforms(GLShaderProgram& program)
+{
+    const GLuint id = program.id;
 
+    program.modelLoc = UGetUniformLocation(id, "model");
 
+    gLinkTimeUniformLookups += 1;
 }
 
-void UBuildCube(GLMesh& mesh)
+// Every uniform lookup goes through here so the frame stats can count them
+GLint UGetUniformLocation(GLuint programId, const char* name)
 {
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
+    ++gFrameStats.uniformLookups;
+    return glGetUniformLocation(programId, name);
+}
 
-    mesh.v = {
-        0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	0.5f,	// front left
-        -0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	0.5f,
-        -0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	1.0f,
+// Typed uniform setters; the program must already be in use.
+// Uniforms the program optimized away (location -1) are skipped.
+void USetUniform(GLint location, float value)
+{
+    if (location < 0)
+        return;
 
-        0.5f,	0.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	0.5f,	// front right
-        0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.25f,	1.0f,
-        -0.5f,	1.0f,	0.5f,	0.0f,	0.0f,	1.0f,	1.0f,	0.0f,	1.0f,
+    glUniform1f(location, value);
+    ++gFrameStats.uniformUploads;
+}
 
+void USetUniform(GLint location, const glm::vec2& value)
+{
+    if (location < 0)
+        return;
 
-        0.5f,	0.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	0.5f,	// right front
-        0.5f,	1.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	1.0f,
-        0.5f,	1.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	1.0f,
+    glUniform2fv(location, 1, glm::value_ptr(value));
+    ++gFrameStats.uniformUploads;
+}
 
-        0.5f,	0.0f,	0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.25f,	0.5f,	// right back
-        0.5f,	0.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	0.5f,
-        0.5f,	1.0f,	-0.5f,	1.0f,	0.0f,	0.0f,	1.0f,	0.5f,	1.0f,
+void USetUniform(GLint location, const glm::vec3& value)
+{
+    if (location < 0)
+        return;
 
+    glUniform3fv(location, 1, glm::value_ptr(value));
+    ++gFrameStats.uniformUploads;
+}
 
-        0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	0.5f,	// back left
-        -0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	0.5f,
-        -0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	1.0f,
+void USetUniform(GLint location, const glm::mat4& value)
+{
+    if (location < 0)
+        return;
 
-        0.5f,	0.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	0.5f,	// back right
-        0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.5f,	1.0f,
-        -0.5f,	1.0f,	-0.5f,	0.0f,	0.0f,	-1.0f,	1.0f,	0.75f,	1.0f,
+    glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+    ++gFrameStats.uniformUploads;
+}
 
+// Creates the FrameBlock uniform buffer and attaches it to its binding point.
+// The shaders name the binding themselves, so nothing needs to be set per program.
+void UCreateFrameUniformBuffer()
+{
+    glGenBuffers(1, &gFrameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-        -0.5f,	0.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	0.5f,	// left back
-        -0.5f,	1.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	1.0f,
-        -0.5f,	1.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	1.0f,
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, gFrameUbo);
+}
 
-        -0.5f,	0.0f,	0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	1.0f,	0.5f,	// left front
-        -0.5f,	0.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	0.5f,
-        -0.5f,	1.0f,	-0.5f,	-1.0f,	0.0f,	0.0f,	1.0f,	0.75f,	1.0f,
+// Uploads the camera and light state for this frame in a single buffer update
+void UUpdateFrameUniformBuffer(const glm::mat4& view, const glm::mat4& projection)
+{
+    FrameUniforms frame = {};
 
+    frame.view = view;
+    frame.projection = projection;
 
+    // Spot Light
+    frame.lightColor = gSpotLightColor;
+    frame.lightPos = gSpotLightPosition;
 
+    // Key Light
+    frame.keyLightColor = gKeyLightColor;
+    frame.keyLightPos = gKeyLightPosition;
 
-        -0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// top left
-        -0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.5f,
-        0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+    // Ambient Light
+    frame.ambientLightColor = gAmbientLightColor;
 
-        -0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.5f,	// top right
-        0.5f,	1.0f,	0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
-        0.5f,	1.0f,	-0.5f,	-0.0f,	1.0f,	0.0f,	1.0f,	0.25f,	0.5f,
+    // Camera view
+    frame.viewPosition = gCamera.Position;
 
-        -0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// bottom left
-        -0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.5f,
-        0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-        -0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	0.5f,	// bottom right
-        0.5f,	0.0f,	0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.0f,
-        0.5f,	0.0f,	-0.5f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.25f,	0.5f,
+    ++gFrameStats.bufferUploads;
+}
 
-    };
+void UDestroyFrameUniformBuffer()
+{
+    glDeleteBuffers(1, &gFrameUbo);
+}
 
-    UTranslator(mesh);
+// Creates the instance buffer; it has to exist before any mesh vao is built
+// since each vao records it as the source of its per-instance attributes.
+// UBuildDrawList sizes it once the scene is known.
+void UCreateInstanceBuffer()
+{
+    glGenBuffers(1, &gInstanceVbo);
+    glGenBuffers(1, &gIndirectBuffer);
+}
+
+// Fills gInstances with one record per mesh, in render queue order; UUploadInstances sends it to the GPU
+void UFillInstances(const vector<GLDrawItem>& drawList)
+{
+    // capacity was reserved by UBuildDrawList, so this never reallocates
+    gInstances.resize(gRenderQueue.size());
+
+    for (GLuint i = 0; i < gRenderQueue.size(); ++i)
+    {
+        const GLDrawItem& item = drawList[gRenderQueue[i].itemIndex];
+
+        gInstances[i].model = item.model;
+        gInstances[i].transparency = item.transparency;
+        gInstances[i].uvScale = item.uvScale;
+        gInstances[i].textureLayer = (float)item.textureLayer;
+    }
 }
 
-void UBuildCircle(GLMesh& mesh)
+void UUploadInstances()
 {
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
+    // orphan last frame's storage so the upload never waits on draws still using it
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, gInstances.capacity() * sizeof(GLInstance), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, gInstances.size() * sizeof(GLInstance), gInstances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+    ++gFrameStats.bufferUploads;
+}
 
-    float r = mesh.radius;
-    float l = mesh.length;
-    float s = mesh.number_of_sides;
-    float h = mesh.height;
+void UDestroyInstanceBuffer()
+{
+    glDeleteBuffers(1, &gInstanceVbo);
+    glDeleteBuffers(1, &gIndirectBuffer);
+}
+
+// Loads the images into one array texture, one layer each in the order given.
+// Images of another size than the layers are resampled to it.
+bool UCreateTextureArray(const vector<const char*>& filenames, GLuint& textureId)
+{
+    if (filenames.empty())
+        return true;
+
+    GLint maxLayers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    if (filenames.size() > (size_t)maxLayers)
+    {
+        cout << "Failed to load textures: " << filenames.size() << " images, but an array texture holds " << maxLayers << endl;
+        return false;
+    }
+
+    // every image is read as RGBA, so all layers share one format
+    struct Image
+    {
+        unsigned char* pixels;
+        int width;
+        int height;
+    };
+    vector<Image> images;
+    int layerWidth = 1, layerHeight = 1;
+
+    for (const char* filename : filenames)
+    {
+        Image image;
+        int channels;
+        image.pixels = stbi_load(filename, &image.width, &image.height, &channels, 4);
+        if (!image.pixels)
+        {
+            cout << "Failed to load texture " << filename << endl;
+            for (Image& loaded : images)
+                stbi_image_free(loaded.pixels);
+            return false;
+        }
+
+        flipImageVertically(image.pixels, image.width, image.height, 4);
+        images.push_back(image);
+        layerWidth = max(layerWidth, image.width);
+        layerHeight = max(layerHeight, image.height);
+    }
+
+    layerWidth = min(layerWidth, MAX_TEXTURE_LAYER_SIZE);
+    layerHeight = min(layerHeight, MAX_TEXTURE_LAYER_SIZE);
+
+    GLsizei levels = 1;
+    while ((max(layerWidth, layerHeight) >> levels) > 0)
+        levels++;
+
+    glGenTextures(1, &textureId);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, layerWidth, layerHeight, images.size());
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    vector<unsigned char> resampled;
+    for (GLuint layer = 0; layer < images.size(); layer++)
+    {
+        const Image& image = images[layer];
+        const unsigned char* pixels = image.pixels;
+        if (image.width != layerWidth || image.height != layerHeight)
+        {
+            UResampleImage(image.pixels, image.width, image.height, layerWidth, layerHeight, resampled);
+            pixels = resampled.data();
+        }
+
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, layerWidth, layerHeight, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        stbi_image_free(image.pixels);
+    }
+
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
+
+    cout << "INFO: Textures: " << images.size() << " images in one " << layerWidth << "x" << layerHeight << " array texture" << endl;
+    return true;
+}
+
+// Bilinear resample of an RGBA image. It wraps around the edges, since the
+// textures repeat.
+void UResampleImage(const unsigned char* pixels, int width, int height, int newWidth, int newHeight, vector<unsigned char>& resampled)
+{
+    resampled.resize(size_t(newWidth) * newHeight * 4);
 
-    constexpr float PI = 3.14f;
-    const float sectorStep = 2.0f * PI / s;
+    for (int y = 0; y < newHeight; y++)
+    {
+        const float sourceY = (y + 0.5f) * height / newHeight - 0.5f;
+        const int y0 = (int)floorf(sourceY);
+        const float fy = sourceY - y0;
+        const int row0 = (y0 + height) % height;
+        const int row1 = (y0 + 1) % height;
 
-    vector<float> v;
+        for (int x = 0; x < newWidth; x++)
+        {
+            const float sourceX = (x + 0.5f) * width / newWidth - 0.5f;
+            const int x0 = (int)floorf(sourceX);
+            const float fx = sourceX - x0;
+            const int column0 = (x0 + width) % width;
+            const int column1 = (x0 + 1) % width;
+
+            for (int c = 0; c < 4; c++)
+            {
+                auto at = [&](int row, int column) { return (float)pixels[(size_t(row) * width + column) * 4 + c]; };
+                const float top = at(row0, column0) * (1.0f - fx) + at(row0, column1) * fx;
+                const float bottom = at(row1, column0) * (1.0f - fx) + at(row1, column1) * fx;
+                resampled[(size_t(y) * newWidth + x) * 4 + c] = (unsigned char)(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
 
+void UDestroyTexture(GLuint textureId)
+{
+    glDeleteTextures(1, &textureId);
+}
 
+// Sends the mesh's vertices and indices to the GPU, registers the buffers in
+// the geometry cache and frees the CPU copy. Shapes that fit
+// in 16-bit indices go into the geometry arena; bigger ones get their own vao.
+void UUploadGeometry(GLMesh& mesh)
+{
+    const GLuint nVertices = mesh.v.size() / FLOATS_PER_VERTEX;
 
-    for (auto i = 1; i < s + 1; i++)
+    // shapes built as a plain triangle list (cube, plane) draw their vertices in order
+    if (mesh.indices.empty())
     {
+        mesh.indices.resize(nVertices);
+        for (GLuint i = 0; i < nVertices; i++)
+            mesh.indices[i] = i;
+    }
 
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
+    mesh.nIndices = mesh.indices.size();
+    mesh.nVertices = nVertices;
+    mesh.geometryId = ++gNextGeometryId;
+    UComputeBounds(mesh);
 
-        one -= 0.5f;
-        one *= 2.0f;
+    // levels of detail are never picked, the full detail shape stands in
+    if (mesh.lodOf < 0)
+        UBuildPickGeometry(mesh);
 
-        two -= 0.5f;
-        two *= 2.0f;
+    // the GPU copy is in the scene's vertex format, usually much smaller
+    vector<unsigned char> packed(nVertices * gVertexFormat->stride);
+    UPackVertices(mesh.v.data(), nVertices, *gVertexFormat, packed.data());
 
-        c[0] = one;
-        c[2] = two;
-        // triangle fan, top
-        v.insert(v.end(), { 0.5f, 0.0f, 0.5f, 0.0f, 1.0f, 0.0f, 1.0f, 0.5f, 0.5f });			// origin (0.5, 0.5) works best for textures
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,										// build this fan the 'l' value away from the other fan
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,					// color data r g b a
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,
-                                        0.5f + (0.5f * sin((i)*sectorStep)) });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,					// color data r g b a
-                                        0.5f + (0.5f * cos((i + 1) * sectorStep)) ,
-                                        0.5f + (0.5f * sin((i + 1) * sectorStep)) });
+    if (nVertices <= 65536)
+    {
+        GLuint firstVertex;
+        GLuint firstIndex;
+        while (!UArenaAllocate(gArena.freeVertices, nVertices, firstVertex))
+            UGrowArena(nVertices, 0);
+        while (!UArenaAllocate(gArena.freeIndices, mesh.nIndices, firstIndex))
+            UGrowArena(0, mesh.nIndices);
+
+        mesh.vao = gArena.vao;
+        mesh.baseVertex = firstVertex;
+        mesh.firstIndex = firstIndex;
+        mesh.indexType = GL_UNSIGNED_SHORT;
+
+        // indices stay relative to the mesh; the base vertex offsets them when drawing
+        const vector<GLushort> shortIndices(mesh.indices.begin(), mesh.indices.end());
+
+        glBindBuffer(GL_ARRAY_BUFFER, gArena.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)firstVertex * gVertexFormat->stride, packed.size(), packed.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // the element buffer binding belongs to whichever vao is bound, and
+        // core profiles have none outside one, so go through a copy binding
+        glBindBuffer(GL_COPY_WRITE_BUFFER, gArena.ebo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)firstIndex * sizeof(GLushort), shortIndices.size() * sizeof(GLushort), shortIndices.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
     }
-    mesh.v = v;
-    v.clear();
-    UTranslator(mesh);
-}
+    else
+    {
+        glGenVertexArrays(1, &mesh.vao);
+        glBindVertexArray(mesh.vao);
 
-void UBuildHollowCylinder(GLMesh& mesh)
-{
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
+        // Create VBO and EBO
+        glGenBuffers(2, mesh.vbos);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
+        glBufferData(GL_ARRAY_BUFFER, packed.size(), packed.data(), GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    float ir = mesh.innerRadius;
-    float r = mesh.radius;
-    float h = mesh.height;
-    float s = mesh.number_of_sides;
+        USetVertexAttributes(mesh.vbos[0]);
 
-    constexpr float PI = 3.14f;
-    const float sectorStep = 2.0f * PI / s;
-
-    vector<float> v;
-
-    for (auto i = 0; i < s; i++)
-    {
-
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
-
-        two -= 0.5f;
-        two *= 2.0f;
-
-        c[0] = one;
-        c[2] = two;
-
-
-        // FOR TEXTURE COORDS
-        // use distance formula
-        // x2 = x1 + d * cos(theta)
-        // y2 = y1 + d * sin(theta)
-        //
-        // x1 = 0.5, d = 0.5 for outer radius, always; d = (inner radius / outer radius * 0.5)
-        // theta = i * sectorStep
-        //
-        // y1 = 0.125, d = 0.125 for outer radius, always; d = (inner radius / outer radius * 0.125)
-        // theta = i * sectorStep
-        //
-
-
-        //BOTTOM OF HOLLOW CYLINDER
-        v.insert(v.end(), { 0.5f + ir * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin(i * sectorStep) ,
-                                        -c[0], -1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i)*sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i)*sectorStep))) });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,					// x
-                                        0.0f ,												// y
-                                        0.5f + r * sin(i * sectorStep) ,					// z
-                                        c[0], -1.0f, c[2], 1.0f,							// color data r g b a
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,			// texture x; adding the origin for proper alignment
-                                        (0.125f + 0.125f * sin((i)*sectorStep)) });		// texture y
-
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], -1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i + 1) * sectorStep))) });
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], -1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i + 1) * sectorStep))) });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], -1.0f, c[2], 1.0f,
-                                        0.5f + (0.5f * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + 0.125f * sin((i + 1) * sectorStep)) });
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], -1.0f, c[2], 1.0f,
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,
-                                        (0.125f + (0.125f * sin((i)*sectorStep))) });
-
-    }
-
-    for (auto i = 0; i < s; i++)
-    {
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
-
-        two -= 0.5f;
-        two *= 2.0f;
-
-        c[0] = one;
-        c[2] = two;
-
-        //TOP OF HOLLOW CYLINDER
-        v.insert(v.end(), { 0.5f + ir * cos(i * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin(i * sectorStep) ,
-                                        -c[0], 1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i)*sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i)*sectorStep))) });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,					// x
-                                        h ,												// y
-                                        0.5f + r * sin(i * sectorStep) ,					// z
-                                        c[0], 1.0f, c[2], 1.0f,							// color data r g b a
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,			// texture x; adding the origin for proper alignment
-                                        (0.125f + 0.125f * sin((i)*sectorStep)) });		// texture y
-
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], 1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i + 1) * sectorStep))) });
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], 1.0f, -c[2], 1.0f,
-                                        0.5f + ((ir / r * 0.5f) * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + ((ir / r * 0.125f) * sin((i + 1) * sectorStep))) });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,
-                                        0.5f + (0.5f * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + 0.125f * sin((i + 1) * sectorStep)) });
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,
-                                        (0.125f + (0.125f * sin((i)*sectorStep))) });
+        // the element buffer binding is part of the vao state
+        mesh.indexType = GL_UNSIGNED_INT;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(GLuint), mesh.indices.data(), GL_STATIC_DRAW);
 
+        glBindVertexArray(0);
     }
 
-    constexpr float x = 1.0f;
-    float j = 1.0f / (s / x);	// for calculating texture location; change 'x' to increase or decrease how many times the texture wraps around the cylinder
-    float k = 0.0f;				// for texture clamping
-
-
-    // OUTSIDE SIDES OF HOLLOW CYLINDER
-    for (auto i = 0; i < s; i++)
-    {
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
-
-        two -= 0.5f;
-        two *= 2.0f;
-
-        c[0] = one;
-        c[2] = two;
-
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k,
-                                        0.25f });
-        k += j;
-    }
-
-    // INSIDE SIDES OF HOLLOW CYLINDER
-    for (auto i = 0; i < s; i++)
-    {
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
-
-        two -= 0.5f;
-        two *= 2.0f;
-
-        c[0] = one;
-        c[2] = two;
-
-
-        v.insert(v.end(), { 0.5f + ir * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin(i * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + ir * cos(i * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin(i * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + ir * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin((i + 1) * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + ir * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + ir * sin(i * sectorStep) ,
-                                        -c[0], 0.0f, -c[2], c[3],					// color data r g b a
-                                        k,
-                                        0.25f });
-        k += j;
-    }
-
-
-
-
-    mesh.v = v;
-
-    UTranslator(mesh);
+    // the GPU has its own copy now
+    vector<float>().swap(mesh.v);
+    vector<GLuint>().swap(mesh.indices);
 
+    gGeometryCache[UGeometryKey(mesh)] = { mesh.vao, { mesh.vbos[0], mesh.vbos[1] }, mesh.baseVertex, mesh.firstIndex,
+        mesh.nVertices, mesh.nIndices, mesh.indexType, mesh.geometryId, mesh.boundsMin, mesh.boundsMax, mesh.boundsRadius, 1 };
 }
 
-void UBuildCylinder(GLMesh& mesh)
+// Points the vertex attributes of the bound vao at vbo, in the scene's vertex
+// format, and the per-instance attributes at the instance buffer
+void USetVertexAttributes(GLuint vbo)
 {
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
-
-    float r = mesh.radius;
-    float h = mesh.height;
-    float s = mesh.number_of_sides;
-
-
-    constexpr float PI = 3.14f;
-    const float sectorStep = 2.0f * PI / s;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    UApplyVertexFormat(*gVertexFormat);
 
-    vector<float> v;
+    // per-instance attributes, advanced once per instance instead of per vertex
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceVbo);
 
-    for (auto i = 0; i < s; i++)
+    // model matrix, one column per location
+    for (GLuint column = 0; column < 4; column++)
     {
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
+        glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(GLInstance), (void*)(offsetof(GLInstance, model) + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(3 + column, 1);
+        glEnableVertexAttribArray(3 + column);
+    }
 
-        two -= 0.5f;
-        two *= 2.0f;
+    // transparency
+    glVertexAttribPointer(7, 1, GL_FLOAT, GL_FALSE, sizeof(GLInstance), (void*)offsetof(GLInstance, transparency));
+    glVertexAttribDivisor(7, 1);
+    glEnableVertexAttribArray(7);
 
-        c[0] = one;
-        c[2] = two;
+    // texture scale
+    glVertexAttribPointer(8, 2, GL_FLOAT, GL_FALSE, sizeof(GLInstance), (void*)offsetof(GLInstance, uvScale));
+    glVertexAttribDivisor(8, 1);
+    glEnableVertexAttribArray(8);
 
+    // texture layer
+    glVertexAttribPointer(9, 1, GL_FLOAT, GL_FALSE, sizeof(GLInstance), (void*)offsetof(GLInstance, textureLayer));
+    glVertexAttribDivisor(9, 1);
+    glEnableVertexAttribArray(9);
 
-        // triangle fan, bottom
-        v.insert(v.end(), { 0.5f, 0.0f, 0.5f, 0.0f, -1.0f, 0.0f, 1.0f, 0.5f, 0.125f });			// origin (0.5, 0.5) works best for textures
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,			// x
-                                        0.0f ,										// y
-                                        0.5f + r * sin(i * sectorStep) ,			// z
-                                        c[0], -1.0f, c[2], 1.0f,						// color data r g b a
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,		// texture x; adding the origin for proper alignment
-                                        (0.125f + (0.125f * sin((i)*sectorStep))) });		// texture y
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
+// Creates the vertex attribute pointers of the bound vao for vertices in
+// format, read from the bound array buffer
+void UApplyVertexFormat(const VertexFormat& format)
+{
+    for (const VertexAttribute& attribute : format.attributes)
+    {
+        glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized,
+            format.stride, (void*)(uintptr_t)attribute.offset);
+        glEnableVertexAttribArray(attribute.location);
+    }
+}
 
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], -1.0f, c[2], 1.0f,						// color data r g b a
-                                        0.5f + (0.5f * cos((i + 1) * sectorStep)) ,
-                                        (0.125f + (0.125f * sin((i + 1) * sectorStep))) });
+// Converts generated vertices (FLOATS_PER_VERTEX floats each) into format
+void UPackVertices(const float* vertices, GLuint nVertices, const VertexFormat& format, unsigned char* out)
+{
+    for (GLuint i = 0; i < nVertices; i++, vertices += FLOATS_PER_VERTEX, out += format.stride)
+    {
+        for (const VertexAttribute& attribute : format.attributes)
+        {
+            const float* in = vertices + GENERATED_ATTRIBUTE_FLOAT[attribute.location];
+            unsigned char* at = out + attribute.offset;
+
+            if (attribute.type == GL_INT_2_10_10_10_REV)
+            {
+                // generated normals are scaled with the radius, and snorm
+                // components clamp at 1, so only a unit normal keeps its direction
+                glm::vec3 normal(in[0], in[1], in[2]);
+                const float length = glm::length(normal);
+                if (length > 0.0f)
+                    normal /= length;
+                const uint32_t packed = glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+                memcpy(at, &packed, sizeof(packed));
+            }
+            else if (attribute.type == GL_HALF_FLOAT)
+            {
+                for (GLint c = 0; c < attribute.components; c++)
+                {
+                    const uint16_t half = glm::packHalf1x16(in[c]);
+                    memcpy(at + c * sizeof(half), &half, sizeof(half));
+                }
+            }
+            else
+            {
+                memcpy(at, in, attribute.components * sizeof(float));
+            }
+        }
+    }
+}
 
+// Packs the mesh's vertices in the compact format and returns the largest
+// difference, per component, between an unpacked normal and the unit normal
+// in the generated direction
+float UPackedNormalError(const GLMesh& mesh)
+{
+    const GLuint nVertices = mesh.v.size() / FLOATS_PER_VERTEX;
+    vector<unsigned char> packed(nVertices * gCompactVertexFormat.stride);
+    UPackVertices(mesh.v.data(), nVertices, gCompactVertexFormat, packed.data());
 
+    GLuint normalOffset = 0;
+    for (const VertexAttribute& attribute : gCompactVertexFormat.attributes)
+    {
+        if (attribute.type == GL_INT_2_10_10_10_REV)
+            normalOffset = attribute.offset;
     }
 
-    for (auto i = 1; i < s + 1; i++)
+    float error = 0.0f;
+    for (GLuint i = 0; i < nVertices; i++)
     {
+        const float* in = mesh.v.data() + i * FLOATS_PER_VERTEX + GENERATED_ATTRIBUTE_FLOAT[1];
+        uint32_t bits;
+        memcpy(&bits, packed.data() + i * gCompactVertexFormat.stride + normalOffset, sizeof(bits));
+
+        const glm::vec3 expected = glm::normalize(glm::vec3(in[0], in[1], in[2]));
+        const glm::vec3 unpacked = glm::vec3(glm::unpackSnorm3x10_1x2(bits));
+        for (int c = 0; c < 3; c++)
+            error = max(error, fabsf(unpacked[c] - expected[c]));
+    }
 
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
+    return error;
+}
 
-        one -= 0.5f;
-        one *= 2.0f;
+// Creates the geometry arena's vao and buffers with room for the given
+// number of vertices and indices. Needs the instance buffer to exist.
+void UCreateGeometryArena(GLuint vertexCapacity, GLuint indexCapacity)
+{
+    gArena.vertexCapacity = vertexCapacity;
+    gArena.indexCapacity = indexCapacity;
+    gArena.freeVertices = { { 0, vertexCapacity } };
+    gArena.freeIndices = { { 0, indexCapacity } };
 
-        two -= 0.5f;
-        two *= 2.0f;
+    glGenVertexArrays(1, &gArena.vao);
+    glBindVertexArray(gArena.vao);
 
-        c[0] = one;
-        c[2] = two;
-        // triangle fan, top
-        v.insert(v.end(), { 0.5f, h, 0.5f, 0.0f, 1.0f, 0.0f, 1.0f, 0.5f, 0.875f });			// origin (0.5, 0.5) works best for textures
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        h ,										// build this fan the 'l' value away from the other fan
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,					// color data r g b a
-                                        0.5f + (0.5f * cos((i)*sectorStep)) ,
-                                        0.875f + (0.125f * sin((i)*sectorStep)) });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 1.0f, c[2], 1.0f,					// color data r g b a
-                                        0.5f + (0.5f * cos((i + 1) * sectorStep)) ,
-                                        0.875f + (0.125f * sin((i + 1) * sectorStep)) });
-    }
+    glGenBuffers(1, &gArena.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, gArena.vbo);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)vertexCapacity * gVertexFormat->stride, nullptr, GL_DYNAMIC_DRAW);
+    USetVertexAttributes(gArena.vbo);
 
-    // since all side triangles have the same points as the fans above, the same calculations are used
-    // to wrap the texture around the cylinder, the calculated points are used to determine which section of
-    // the texture to clamp to the corresponding point.
-    constexpr float x = 1.0f;
-    float j = 1.0f / (s / x);	// for calculating texture location; change 'x' to increase or decrease how many times the texture wraps around the cylinder
-    float k = 0.0f;				// for texture clamping
-
-    // sides
-    for (auto i = 0; i < s; i++)
-    {
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
-
-        one -= 0.5f;
-        one *= 2.0f;
-
-        two -= 0.5f;
-        two *= 2.0f;
-
-        c[0] = one;
-        c[2] = two;
-
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        h ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.75f });
-        v.insert(v.end(), { 0.5f + r * cos((i + 1) * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin((i + 1) * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k + j ,
-                                        0.25f });
-
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], 0.0f, c[2], c[3],					// color data r g b a
-                                        k,
-                                        0.25f });
-        k += j;
-    }
-
-    mesh.v = v;
-    v.clear();
-    UTranslator(mesh);
+    glGenBuffers(1, &gArena.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gArena.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)indexCapacity * sizeof(GLushort), nullptr, GL_DYNAMIC_DRAW);
 
+    glBindVertexArray(0);
 }
 
-
-void UBuildCone(GLMesh& mesh)
+void UDestroyGeometryArena()
 {
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
-
-    float r = mesh.radius;
-    float h = mesh.height;
-    float s = mesh.number_of_sides;
+    // every mesh should have handed its ranges back by now
+    assert(UArenaUsed(gArena.freeVertices, gArena.vertexCapacity) == 0);
+    assert(UArenaUsed(gArena.freeIndices, gArena.indexCapacity) == 0);
+    assert(gArena.freeVertices.size() <= 1 && gArena.freeIndices.size() <= 1);
+
+    glDeleteVertexArrays(1, &gArena.vao);
+    glDeleteBuffers(1, &gArena.vbo);
+    glDeleteBuffers(1, &gArena.ebo);
+    gArena = GeometryArena();
+}
 
-    constexpr float PI = 3.14f;
-    const float sectorStep = 2.0f * PI / s;
-    const float textStep = 1.0f / s;
-    float textureXLoc = 0.0f;
+// Takes count entries from the first free run big enough for them
+bool UArenaAllocate(vector<ArenaRange>& freeList, GLuint count, GLuint& first)
+{
+    for (auto it = freeList.begin(); it != freeList.end(); ++it)
+    {
+        if (it->count < count)
+            continue;
+
+        first = it->first;
+        it->first += count;
+        it->count -= count;
+        if (it->count == 0)
+            freeList.erase(it);
+        return true;
+    }
 
-    vector<float> v;
+    return false;
+}
 
-    for (auto i = 1; i < s + 1; i++) {
+// Returns a run to the free list, merging it with the runs either side of it
+void UArenaFree(vector<ArenaRange>& freeList, GLuint first, GLuint count)
+{
+    if (count == 0)
+        return;
 
-        float one = 0.5f + r * cos(i * sectorStep);
-        float two = 0.5f + r * sin(i * sectorStep);
+    auto it = lower_bound(freeList.begin(), freeList.end(), first,
+        [](const ArenaRange& range, GLuint value) { return range.first < value; });
+    it = freeList.insert(it, { first, count });
 
-        one -= 0.5f;
-        one *= 2.0f;
+    auto next = it + 1;
+    if (next != freeList.end() && it->first + it->count == next->first)
+    {
+        it->count += next->count;
+        freeList.erase(next);
+    }
 
-        two -= 0.5f;
-        two *= 2.0f;
+    if (it != freeList.begin())
+    {
+        auto previous = it - 1;
+        if (previous->first + previous->count == it->first)
+        {
+            previous->count += it->count;
+            freeList.erase(it);
+        }
+    }
+}
 
-        c[0] = one;
-        c[2] = two;
+// Entries of the arena buffer currently handed out
+GLuint UArenaUsed(const vector<ArenaRange>& freeList, GLuint capacity)
+{
+    GLuint free = 0;
+    for (const ArenaRange& range : freeList)
+        free += range.count;
 
+    return capacity - free;
+}
 
-        // triangle fan, bottom
-        v.insert(v.end(), { 0.5f, 0.0f, 0.5f, c[0], -1.0f, c[2], c[3], 0.5f, 0.25f });		// center point; x, y, z, r, g, b, a, texture x, texture y
-        v.insert(v.end(), { 0.5f + r * cos(i * sectorStep) ,				// first outer point
-                                        0.0f ,
-                                        0.5f + r * sin(i * sectorStep) ,
-                                        c[0], -1.0f, c[2], c[3],
-            /*textureXLoc,
-            0.0f*/
-           0.5f + (r * cos((i)*sectorStep)) ,	// texture x; adding the origin for proper alignment
-            0.5f + (r * sin((i)*sectorStep))
-            });
-        v.insert(v.end(), { 0.5f + (r * cos((i + 1) * sectorStep)) ,		// second outer point
-                                        0.0f ,
-                                        0.5f + (r * sin((i + 1) * sectorStep)) ,
-                                        c[0], -1.0f, c[2], c[3],
-            /*textureXLoc + textStep,
-            0.0f*/
-            0.5f + (r * cos((i + 1) * sectorStep)) ,
-            0.25f + (0.25f * sin((i + 1) * sectorStep))
-            });
+// Replaces buffer with a bigger one holding the same data, and returns it
+GLuint UGrowBuffer(GLuint buffer, GLsizeiptr oldBytes, GLsizeiptr newBytes)
+{
+    GLuint grown;
+    glGenBuffers(1, &grown);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glBufferData(GL_COPY_WRITE_BUFFER, newBytes, nullptr, GL_DYNAMIC_DRAW);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldBytes);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+    return grown;
+}
 
+// Makes room for at least minVertices more vertices and minIndices more
+// indices, doubling the buffers. Ranges keep their offsets, so meshes already
+// in the arena stay valid.
+void UGrowArena(GLuint minVertices, GLuint minIndices)
+{
+    glBindVertexArray(gArena.vao);
 
-        // side triangle + point
-        v.insert(v.end(), { 0.5f + (r * cos(i * sectorStep)) ,
-                                        0.0f ,
-                                        0.5f + (r * sin(i * sectorStep)) ,
-                                        c[0], 1.0f, c[2], c[3],
-                                        textureXLoc ,
-                                        0.0f });
-        v.insert(v.end(), { 0.5f + (r * cos((i + 1) * sectorStep)) ,
-                                        0.0f ,
-                                        0.5f + (r * sin((i + 1) * sectorStep)) ,
-                                        c[0], 1.0f, c[2], c[3],
-                                        textureXLoc + textStep,
-                                        0.0f });
-        v.insert(v.end(), { 0.5f , h , 0.5f , c[0], 1.0f, c[2], c[3], textureXLoc + (textStep / 2), 1.0f });		// origin, peak
+    if (minVertices > 0)
+    {
+        const GLuint capacity = max(gArena.vertexCapacity * 2, gArena.vertexCapacity + minVertices);
+        const GLsizeiptr vertexBytes = gVertexFormat->stride;
+        gArena.vbo = UGrowBuffer(gArena.vbo, gArena.vertexCapacity * vertexBytes, capacity * vertexBytes);
+        UArenaFree(gArena.freeVertices, gArena.vertexCapacity, capacity - gArena.vertexCapacity);
+        gArena.vertexCapacity = capacity;
+
+        // the attribute pointers still reference the old buffer
+        USetVertexAttributes(gArena.vbo);
+    }
 
-        textureXLoc += textStep;
+    if (minIndices > 0)
+    {
+        const GLuint capacity = max(gArena.indexCapacity * 2, gArena.indexCapacity + minIndices);
+        gArena.ebo = UGrowBuffer(gArena.ebo, gArena.indexCapacity * sizeof(GLushort), capacity * sizeof(GLushort));
+        UArenaFree(gArena.freeIndices, gArena.indexCapacity, capacity - gArena.indexCapacity);
+        gArena.indexCapacity = capacity;
 
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gArena.ebo);
     }
 
-    mesh.v = v;
-    v.clear();	// clear the local vector
-
-    UTranslator(mesh);
+    glBindVertexArray(0);
 }
 
-
-
-void UBuildPlane(GLMesh& mesh)
+void UTranslator(GLMesh& mesh)
 {
-    vector<float> c = { mesh.p[0], mesh.p[1], mesh.p[2], mesh.p[3] };
-
+    // build the mesh, unless it came out of the geometry cache
+    if (mesh.vao == 0)
+        UUploadGeometry(mesh);
 
+    // scale the object
+    const glm::mat4 scale = glm::scale(glm::vec3(mesh.p[4], mesh.p[5], mesh.p[6]));
 
-    mesh.v = {
+    const glm::mat4 rot = glm::mat4(1.0f);
 
-        -1.0f,	0.0f,	-1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	// 0
-         0.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 1
-        -1.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	0.0f,	// 2
+    // rotate the object (x, y, z) (0 - 6.4, to the right)
+    const glm::mat4 xrotation = glm::rotate(rot, glm::radians(mesh.p[7]), glm::vec3(mesh.p[8], mesh.p[9], mesh.p[10]));
+    const glm::mat4 yrotation = glm::rotate(rot, glm::radians(mesh.p[11]), glm::vec3(mesh.p[12], mesh.p[13], mesh.p[14]));
+    const glm::mat4 zrotation = glm::rotate(rot, glm::radians(mesh.p[15]), glm::vec3(mesh.p[16], mesh.p[17], mesh.p[18]));
 
-        -1.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	// 0
-         0.0f,	0.0f,	 1.0f,	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 2
-         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
 
-         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
-         0.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	0.0f,	// 2
-         1.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	0.0f,	// 5
+    // move the object (x, y, z)
+    const glm::mat4 translation = glm::translate(glm::vec3(mesh.p[19], mesh.p[20], mesh.p[21]));
 
-         0.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	0.5f,	1.0f,	// 3
-         1.0f,	0.0f,	 1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	0.0f,	// 5
-         1.0f,	0.0f,	-1.0f, 	0.0f,	1.0f,	0.0f,	1.0f,	1.0f,	1.0f,	// 4
+    mesh.model = translation * xrotation * zrotation * yrotation * scale;
 
-    };
+    mesh.gUVScale = glm::vec2(mesh.p[22], mesh.p[23]);		// scales the text
 
-    UTranslator(mesh);
 
 }
 
 
+void UDestroyShaderProgram(GLuint programId)
+{
+    glDeleteProgram(programId);
+}
 
-void UDestroyMesh(GLMesh& mesh)
+// Adds this frame's counters to the running totals and prints the
+// per-frame averages about once a second
+void UReportFrameStats(float currentTime)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(2, mesh.vbos);
+    gStatsTotal.uniformLookups += gFrameStats.uniformLookups;
+    gStatsTotal.uniformUploads += gFrameStats.uniformUploads;
+    gStatsTotal.bufferUploads += gFrameStats.bufferUploads;
+    gStatsTotal.drawCalls += gFrameStats.drawCalls;
+    gStatsTotal.instances += gFrameStats.instances;
+    gStatsTotal.programSwitches += gFrameStats.programSwitches;
+    gStatsTotal.textureSwitches += gFrameStats.textureSwitches;
+    gStatsTotal.vaoSwitches += gFrameStats.vaoSwitches;
+    gStatsTotal.triangles += gFrameStats.triangles;
+    gStatsTotal.visible += gFrameStats.visible;
+    gStatsTotal.culled += gFrameStats.culled;
+    ++gStatsFrames;
+
+    const float elapsed = currentTime - gStatsLastReport;
+    if (elapsed < 1.0f)
+        return;
+
+    // frame time and jitter, the deviation of the frame start intervals
+    double frameTime = 0.0, jitter = 0.0;
+    if (gPacing.intervals > 0)
+    {
+        frameTime = gPacing.intervalSum / gPacing.intervals;
+        jitter = sqrt(max(0.0, gPacing.intervalSquareSum / gPacing.intervals - frameTime * frameTime));
+    }
+
+    cout << "STATS: " << gStatsFrames / elapsed << " fps (" << gRenderPathNames[gRenderPath] << ", " << gFramePacingNames[gPacing.mode] << ")"
+        << " | frame ms: " << frameTime * 1000.0 << " (jitter " << jitter * 1000.0 << ", max " << gPacing.intervalMax * 1000.0 << ")"
+        << " | uniform lookups/frame: " << gStatsTotal.uniformLookups / gStatsFrames
+        << " (" << gLinkTimeUniformLookups << " resolved at link time)"
+        << " | uniform uploads/frame: " << gStatsTotal.uniformUploads / gStatsFrames
+        << " | buffer updates/frame: " << gStatsTotal.bufferUploads / gStatsFrames
+        << " | draw calls/frame: " << gStatsTotal.drawCalls / gStatsFrames
+        << " (" << gStatsTotal.instances / gStatsFrames << " instances, "
+        << gStatsTotal.triangles / gStatsFrames << " triangles)"
+        << " | visible/culled meshes/frame: " << gStatsTotal.visible / gStatsFrames
+        << "/" << gStatsTotal.culled / gStatsFrames
+        << " | program/texture/vao switches/frame: " << gStatsTotal.programSwitches / gStatsFrames
+        << "/" << gStatsTotal.textureSwitches / gStatsFrames
+        << "/" << gStatsTotal.vaoSwitches / gStatsFrames
+        << endl;
+
+    gStatsTotal = FrameStats();
+    gStatsFrames = 0;
+    gPacing.intervalSum = gPacing.intervalSquareSum = gPacing.intervalMax = 0.0;
+    gPacing.intervals = 0;
+    gStatsLastReport = currentTime;
 }
 
+// Switches the pacing mode; only vsync waits in the swap
+void USetFramePacing(FramePacing mode)
+{
+    gPacing.mode = mode;
+    glfwSwapInterval(mode == pacingVsync ? 1 : 0);
+    gPacing.deadline = glfwGetTime();
+}
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Sleeps, then spins, until deadline. Sleeps stop once the time left is
+// under what one usually takes (measured, since timer granularity differs
+// between systems), and the rest is spun so the deadline is met to within
+// microseconds.
+void UWaitUntil(double deadline)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+#ifdef _WIN32
+    // sleep_for and Sleep take the whole 15.6 ms tick on Windows. High
+    // resolution timers (Windows 10 1803 on) don't; older systems get the
+    // tick shortened to 1 ms for the length of the wait instead.
+    static HANDLE timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!timer)
+        timeBeginPeriod(1);
+#endif
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
+    for (;;)
+    {
+        const double start = glfwGetTime();
+        if (deadline - start <= gPacing.sleepMean + 2.0 * gPacing.sleepDeviation)
+            break;
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+#ifdef _WIN32
+        if (timer)
+        {
+            LARGE_INTEGER due;
+            due.QuadPart = -10000;  // 1 ms from now, in 100 ns units
+            SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE);
+            WaitForSingleObject(timer, INFINITE);
+        }
+        else
+            Sleep(1);
+#else
+        this_thread::sleep_for(chrono::milliseconds(1));
+#endif
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+        // track how long a 1 ms sleep really takes
+        const double error = glfwGetTime() - start - gPacing.sleepMean;
+        gPacing.sleepMean += error * 0.1;
+        gPacing.sleepDeviation += (fabs(error) - gPacing.sleepDeviation) * 0.1;
+    }
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+#ifdef _WIN32
+    if (!timer)
+        timeEndPeriod(1);
+#endif
 
-        return false;
+    while (glfwGetTime() < deadline)
+    {
+#ifdef X86_SIMD
+        _mm_pause();
+#endif
     }
+}
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+// Holds the frame back until its slot when the limiter is on, and measures
+// the interval since the last frame started. Input is read after this, so
+// the wait never sits between reading input and drawing with it.
+void UPaceFrame()
+{
+    if (gPacing.mode == pacingLimited)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        gPacing.deadline += gPacing.targetFrameTime;
 
-        return false;
+        // a frame that ran long starts the schedule over instead of
+        // rushing the next few to catch up
+        const double now = glfwGetTime();
+        if (gPacing.deadline < now)
+            gPacing.deadline = now;
+        else
+            UWaitUntil(gPacing.deadline);
     }
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
-
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+    const double start = glfwGetTime();
+    if (gPacing.lastFrameStart > 0.0)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-
-        return false;
+        const double interval = start - gPacing.lastFrameStart;
+        gPacing.intervalSum += interval;
+        gPacing.intervalSquareSum += interval * interval;
+        gPacing.intervalMax = max(gPacing.intervalMax, interval);
+        gPacing.intervals++;
     }
+    gPacing.lastFrameStart = start;
+}
 
-    glUseProgram(programId);    // Uses the shader program
+// Sleeps until an event comes or the timeout passes, for the on demand mode
+void UWaitForEvents()
+{
+    const double start = glfwGetTime();
+    glfwWaitEventsTimeout(ON_DEMAND_TIMEOUT);
+    const double now = glfwGetTime();
 
-    return true;
+    gIdleStats.waiting += now - start;
+    gIdleStats.wakeups++;
+
+    // time asleep is not frame time: movement starts over from here and the
+    // pacing stats leave the gap out
+    gLastFrame = now;
+    gPacing.lastFrameStart = 0.0;
 }
 
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Prints about once a second how the on demand loop spent its time. Busy is
+// the share of time the loop was not asleep waiting for events, which bounds
+// the CPU it used.
+void UReportIdleStats(double currentTime, bool drew)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
-    {
-        flipImageVertically(image, width, height, channels);
+    if (drew)
+        gIdleStats.frames++;
+    else
+        gIdleStats.skipped++;
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    const double elapsed = currentTime - gIdleStats.lastReport;
+    if (elapsed < 1.0)
+        return;
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    cout << "IDLE: busy " << 100.0 * max(0.0, elapsed - gIdleStats.waiting) / elapsed << "% of " << elapsed << " s"
+        << " | frames drawn: " << gIdleStats.frames
+        << " | checks with nothing to draw: " << gIdleStats.skipped
+        << " | wakeups: " << gIdleStats.wakeups << endl;
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
+    gIdleStats = IdleStats();
+    gIdleStats.lastReport = currentTime;
+}
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+// Framebuffer the headless frames are drawn into instead of a window
+void UCreateOffscreenTarget(int width, int height)
+{
+    glGenFramebuffers(1, &gOffscreen.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreen.fbo);
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    glGenRenderbuffers(2, gOffscreen.renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreen.renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gOffscreen.renderbuffers[0]);
 
-        return true;
-    }
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreen.renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gOffscreen.renderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-    // Error loading the image
-    return false;
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "Offscreen framebuffer is incomplete" << endl;
+
+    // stays bound: every draw of the run goes here
+    glViewport(0, 0, width, height);
+    gViewportHeight = height;
 }
-void UDestroyTexture(GLuint textureId)
+
+void UDestroyOffscreenTarget()
 {
-    glGenTextures(1, &textureId);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &gOffscreen.fbo);
+    glDeleteRenderbuffers(2, gOffscreen.renderbuffers);
+    gOffscreen = OffscreenTarget();
 }
 
-void UTranslator(GLMesh& mesh)
+// The camera path circles the middle of the scene's bounds, starting from
+// where the interactive camera starts. An empty scene has no bounds, so
+// the path circles the origin instead
+void UStartCameraPath()
 {
-    // build the mesh
+    if (gSceneBvh.nodes.empty())
+        gCameraPathCentre = glm::vec3(0.0f);
+    else
+        gCameraPathCentre = (gSceneBvh.nodes[0].boundsMin + gSceneBvh.nodes[0].boundsMax) * 0.5f;
+
+    const glm::vec3 offset = gCamera.Position - gCameraPathCentre;
+    gCameraPathRadius = glm::length(glm::vec3(offset.x, 0.0f, offset.z));
+    gCameraPathHeight = offset.y;
+    gCameraPathStartAngle = atan2f(offset.z, offset.x);
+}
 
-    constexpr GLuint floatsPerVertex = 3;
-    constexpr GLuint floatsPerColor = 4;
-    constexpr GLuint floatsPerUV = 2;
+// Puts the camera at its place on the path for this frame: one full turn
+// around the scene over the run, looking at its middle
+void UScriptedCamera(GLuint frame, GLuint nFrames)
+{
+    const float angle = gCameraPathStartAngle + glm::two_pi<float>() * frame / nFrames;
+    gCamera.Position = gCameraPathCentre + glm::vec3(cosf(angle) * gCameraPathRadius, gCameraPathHeight, sinf(angle) * gCameraPathRadius);
+
+    // the camera only takes its direction as yaw and pitch
+    const glm::vec3 front = glm::normalize(gCameraPathCentre - gCamera.Position);
+    gCamera.Yaw = glm::degrees(atan2f(front.z, front.x));
+    gCamera.Pitch = glm::degrees(asinf(front.y));
+    gCamera.ProcessMouseMovement(0.0f, 0.0f);
+}
 
-    mesh.nIndices = mesh.v.size() / (floatsPerVertex + floatsPerUV + floatsPerColor);
+// Prints the frame times of a headless run
+void UReportHeadlessRun(vector<double>& frameTimes)
+{
+    if (frameTimes.empty())
+        return;
+
+    double total = 0.0;
+    for (double time : frameTimes)
+        total += time;
+
+    // the first frame builds shader variants and is reported on its own
+    const double first = frameTimes.front();
+    sort(frameTimes.begin(), frameTimes.end());
+    auto percentile = [&](double p) { return frameTimes[min(frameTimes.size() - 1, size_t(p * frameTimes.size()))] * 1000.0; };
+
+    cout << "HEADLESS: " << frameTimes.size() << " frames in " << total * 1000.0 << " ms (" << frameTimes.size() / total << " fps)"
+        << " | frame ms: first " << first * 1000.0 << ", min " << frameTimes.front() * 1000.0 << ", mean " << total / frameTimes.size() * 1000.0
+        << ", p50 " << percentile(0.5) << ", p95 " << percentile(0.95) << ", p99 " << percentile(0.99)
+        << ", max " << frameTimes.back() * 1000.0 << endl;
+}
 
-    glGenVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);
+// Writes the colour of the bound framebuffer to a binary PPM file
+bool USaveScreenshot(const char* path, int width, int height)
+{
+    vector<unsigned char> pixels(width * height * 3);
+    UReadFrame(pixels, width, height);
 
-    // Create VBO
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
+    // GL rows go bottom up, PPM rows top down
+    flipImageVertically(pixels.data(), width, height, 3);
 
-    // use vector instead of array
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        mesh.v.size() * sizeof(float),
-        &mesh.v.front(),
-        GL_STATIC_DRAW
-    ); // Sends vertex or coordinate data to the GPU
+    ofstream file(path, ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write((const char*)pixels.data(), pixels.size());
+    return bool(file);
+}
 
-    // Strides between vertex coordinates
-    constexpr GLint stride = sizeof(float) * (floatsPerVertex + floatsPerUV + floatsPerColor);
+// Reads the colour of the bound framebuffer, bottom row first
+void UReadFrame(vector<unsigned char>& pixels, int width, int height)
+{
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+}
 
-    // Create Vertex Attribute Pointers
-    // location
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, (void*)0);
-    glEnableVertexAttribArray(0);
+// Draws the frame just rendered again with every item visible and returns
+// how many pixels differ. Culling only skips what is off screen, so none
+// should. The light orbit is held still so both draws see the same scene.
+GLuint UCompareUnculledFrame(vector<unsigned char>& culled, vector<unsigned char>& unculled)
+{
+    UReadFrame(culled, WINDOW_WIDTH, WINDOW_HEIGHT);
 
-    // color
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    const float deltaTime = gDeltaTime;
+    gDeltaTime = 0.0f;
+    gCullingEnabled = false;
+    URenderScene(gDrawList);
+    gCullingEnabled = true;
+    gDeltaTime = deltaTime;
 
-    // texture
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(7 * sizeof(float)));
-    glEnableVertexAttribArray(2);
+    UReadFrame(unculled, WINDOW_WIDTH, WINDOW_HEIGHT);
 
+    GLuint differing = 0;
+    for (size_t i = 0; i < culled.size(); i += 3)
+        differing += culled[i] != unculled[i] || culled[i + 1] != unculled[i + 1] || culled[i + 2] != unculled[i + 2];
+    return differing;
+}
 
-    // scale the object
-    mesh.scale = glm::scale(glm::vec3(mesh.p[4], mesh.p[5], mesh.p[6]));
+#ifdef PROFILER
+// Starts the clock and makes the GPU timer queries
+void UCreateProfiler()
+{
+    gProfiler.epoch = chrono::steady_clock::now();
+    gProfiler.events.resize(PROFILE_EVENTS);
 
-    const glm::mat4 rot = glm::mat4(1.0f);
+    for (GpuQueryFrame& slot : gProfiler.gpuFrames)
+    {
+        glGenQueries(PROFILE_GPU_SCOPES, slot.queries);
+        slot.count = 0;
+    }
+}
 
-    // rotate the object (x, y, z) (0 - 6.4, to the right)
-    mesh.xrotation = glm::rotate(rot, glm::radians(mesh.p[7]), glm::vec3(mesh.p[8], mesh.p[9], mesh.p[10]));
-    mesh.yrotation = glm::rotate(rot, glm::radians(mesh.p[11]), glm::vec3(mesh.p[12], mesh.p[13], mesh.p[14]));
-    mesh.zrotation = glm::rotate(rot, glm::radians(mesh.p[15]), glm::vec3(mesh.p[16], mesh.p[17], mesh.p[18]));
+void UDestroyProfiler()
+{
+    for (GpuQueryFrame& slot : gProfiler.gpuFrames)
+        glDeleteQueries(PROFILE_GPU_SCOPES, slot.queries);
+}
 
+// Microseconds since the profiler started
+double UProfileNow()
+{
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - gProfiler.epoch).count();
+}
 
-    // move the object (x, y, z)
-    mesh.translation = glm::translate(glm::vec3(mesh.p[19], mesh.p[20], mesh.p[21]));
+// Adds an event to the ring, over the oldest one once it is full
+void UProfileRecord(const char* name, double start, double duration, bool gpu)
+{
+    gProfiler.events[gProfiler.next] = { name, start, duration, gpu };
+    if (++gProfiler.next == PROFILE_EVENTS)
+    {
+        gProfiler.next = 0;
+        gProfiler.full = true;
+    }
+}
 
-    mesh.model = mesh.translation * mesh.xrotation * mesh.zrotation * mesh.yrotation * mesh.scale;
+// Starts the next frame on the query ring. The slot it reuses was issued
+// PROFILE_GPU_FRAMES frames ago, so its results are normally in; any that
+// are not yet are dropped rather than waited for.
+void UProfileNewFrame()
+{
+    gProfiler.frame++;
+    GpuQueryFrame& slot = gProfiler.gpuFrames[gProfiler.frame % PROFILE_GPU_FRAMES];
 
-    mesh.gUVScale = glm::vec2(mesh.p[22], mesh.p[23]);		// scales the text
+    for (GLuint i = 0; i < slot.count; i++)
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(slot.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(slot.queries[i], GL_QUERY_RESULT, &nanoseconds);
+        UProfileRecord(slot.names[i], slot.starts[i], nanoseconds / 1000.0, true);
+    }
+
+    slot.count = 0;
+}
+
+// Times the GPU commands issued until UEndGpuScope. A frame records at most
+// PROFILE_GPU_SCOPES of them; later ones are skipped.
+void UBeginGpuScope(const char* name)
+{
+    assert(!gProfiler.gpuScopeOpen && "GL timer queries cannot nest");
 
+    GpuQueryFrame& slot = gProfiler.gpuFrames[gProfiler.frame % PROFILE_GPU_FRAMES];
+    if (slot.count == PROFILE_GPU_SCOPES)
+        return;
 
+    slot.names[slot.count] = name;
+    slot.starts[slot.count] = UProfileNow();
+    glBeginQuery(GL_TIME_ELAPSED, slot.queries[slot.count]);
+    gProfiler.gpuScopeOpen = true;
 }
 
+void UEndGpuScope()
+{
+    if (!gProfiler.gpuScopeOpen)
+        return;
 
-void UDestroyShaderProgram(GLuint programId)
+    glEndQuery(GL_TIME_ELAPSED);
+    gProfiler.gpuFrames[gProfiler.frame % PROFILE_GPU_FRAMES].count++;
+    gProfiler.gpuScopeOpen = false;
+}
+
+// Writes the recorded events as Chrome trace-event JSON, for chrome://tracing
+// or Perfetto. CPU scopes go on one track and GPU scopes on another, placed
+// where their commands were issued.
+bool UWriteProfileTrace(const char* path)
 {
-    glDeleteProgram(programId);
+    ofstream file(path);
+    if (!file)
+        return false;
+
+    file.setf(ios::fixed);
+    file.precision(3);
+    file << "{\"traceEvents\":[\n"
+        << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+        << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+
+    const GLuint count = gProfiler.full ? PROFILE_EVENTS : gProfiler.next;
+    const GLuint first = gProfiler.full ? gProfiler.next : 0;
+    for (GLuint i = 0; i < count; i++)
+    {
+        const ProfileEvent& event = gProfiler.events[(first + i) % PROFILE_EVENTS];
+        file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.gpu ? 2 : 1)
+            << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+    }
+
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    cout << "INFO: Wrote " << count << " profile events to " << path << endl;
+    return bool(file);
 }
+#endif
 
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
@@ -2318,18 +6795,9 @@ void UCreateLightMesh(GLightMesh& lightMesh)
     glBindBuffer(GL_ARRAY_BUFFER, lightMesh.vbo); // Activates the buffer
     glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
-
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // The vertices above are already laid out as the plain float format
+    static_assert(sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV) == 32, "lamp vertices must match gFloatVertexFormat");
+    UApplyVertexFormat(gFloatVertexFormat);
 }
 
 